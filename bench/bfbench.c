@@ -0,0 +1,519 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Benchmark harness. `bfbench run` compiles a program with bfoc, runs it a
+ * number of times and appends the results to a CSV history, keyed by the
+ * bfoc revision and the compiler flags. `bfbench compare` checks the run
+ * times of two revisions against each other and flags the programs which
+ * got slower by more than the noise.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_BFOC    "./bfoc"
+#define DEFAULT_HISTORY "bench/history.csv"
+#define DEFAULT_RUNS    10
+#define MAX_FIELD       256
+#define MAX_SAMPLES     1024
+
+/**
+ * A row of the history: one timed run of one program.
+ */
+struct sample {
+    char revision[MAX_FIELD];
+    char config[MAX_FIELD];
+    char program[MAX_FIELD];
+    double compile_time;   /* Seconds */
+    long binary_size;      /* Bytes */
+    long max_rss;          /* Kilobytes */
+    double run_time;       /* Seconds */
+};
+
+/**
+ * Summary statistics of a set of measurements.
+ */
+struct stats {
+    int n;
+    double mean;
+    double var;            /* Sample variance */
+};
+
+/**
+ * Compiles and times a program, appending the samples to the history.
+ *
+ * @param argc Argument count, after the command name
+ * @param argv Arguments, after the command name
+ * @return     Exit status
+ */
+static int bench_run(int argc, char** argv);
+
+/**
+ * Compares two revisions in the history and reports regressions.
+ *
+ * @param argc Argument count, after the command name
+ * @param argv Arguments, after the command name
+ * @return     Exit status, 1 if any program regressed significantly
+ */
+static int bench_compare(int argc, char** argv);
+
+/**
+ * Runs a command with optional redirections, measuring its wall time and
+ * peak resident set size.
+ *
+ * @param argv    NULL-terminated command line
+ * @param input   Path to use as standard input, NULL to inherit
+ * @param output  Path to write standard output to, NULL to inherit
+ * @param elapsed Set to the wall time in seconds
+ * @param max_rss Set to the peak resident set size in kilobytes, may be NULL
+ * @return        Wait status of the command, nonzero on failure
+ */
+static int run_timed(char** argv, const char* input, const char* output, double* elapsed, long* max_rss);
+
+/**
+ * Describes the revision of the bfoc being benchmarked, from the git tree
+ * it was built in.
+ *
+ * @param bfoc Compiler path
+ * @param buf  Buffer to write the revision to
+ * @param size Buffer size
+ */
+static void current_revision(const char* bfoc, char* buf, int size);
+
+/**
+ * Reads every sample in a history file.
+ *
+ * @param path    History path
+ * @param samples Set to the samples read, to be freed by the caller
+ * @return        Number of samples, -1 if the history couldn't be read
+ */
+static int read_history(const char* path, struct sample** samples);
+
+/**
+ * Computes statistics of the run times of a program and configuration at
+ * a revision.
+ *
+ * @param samples  History samples
+ * @param n        Number of samples
+ * @param revision Revision to select
+ * @param ref      Sample naming the program and configuration to select
+ * @param field    Offset of the double to summarize within a sample
+ */
+static struct stats summarize(const struct sample* samples, int n, const char* revision, const struct sample* ref, size_t field);
+
+/**
+ * Returns the two-sided 95% critical value of Student's t distribution.
+ *
+ * @param df Degrees of freedom
+ */
+static double t_critical(double df);
+
+/**
+ * Replaces the CSV separators in a field, so it reads back whole.
+ *
+ * @param str Field to clean in place
+ */
+static void clean_field(char* str);
+
+/**
+ * Outputs usage to stderr.
+ *
+ * @param cmd First command line argument passed to main (argv[0])
+ * @return    EXIT_FAILURE
+ */
+static int usage(const char* cmd);
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        return usage(*argv);
+    }
+
+    if (!strcmp(argv[1], "run")) {
+        return bench_run(argc - 1, argv + 1);
+    } else if (!strcmp(argv[1], "compare")) {
+        return bench_compare(argc - 1, argv + 1);
+    }
+
+    return usage(*argv);
+}
+
+int bench_run(int argc, char** argv) {
+    const char* bfoc = DEFAULT_BFOC;
+    const char* history = DEFAULT_HISTORY;
+    const char* input = "/dev/null";
+    int runs = DEFAULT_RUNS, opt;
+
+    while ((opt = getopt(argc, argv, "+B:f:i:n:")) != -1) {
+        switch (opt) {
+        case 'B':
+            bfoc = optarg;
+            break;
+        case 'f':
+            history = optarg;
+            break;
+        case 'i':
+            input = optarg;
+            break;
+        case 'n':
+            runs = atoi(optarg);
+
+            if (runs < 2 || runs > MAX_SAMPLES) {
+                fprintf(stderr, "error: run count must be between 2 and %d\n", MAX_SAMPLES);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            return usage("bfbench");
+        }
+    }
+
+    if (optind >= argc) {
+        return usage("bfbench");
+    }
+
+    /* Everything after the program is passed on to bfoc. */
+    const char* program = argv[optind++];
+    char binary[] = "/tmp/bfbench.XXXXXX", output[] = "/tmp/bfbench.XXXXXX";
+    int binary_fd = mkstemp(binary), output_fd = mkstemp(output);
+
+    if (binary_fd < 0 || output_fd < 0) {
+        fprintf(stderr, "error: couldn't create temporary file: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    close(binary_fd);
+    close(output_fd);
+
+    struct sample s = { .binary_size = 0 };
+    char** bfoc_argv = calloc(argc - optind + 5, sizeof(char*));
+    int bfoc_argc = 0, config_len = 0;
+
+    bfoc_argv[bfoc_argc++] = (char*) bfoc;
+
+    for (int i = optind; i < argc; ++i) {
+        bfoc_argv[bfoc_argc++] = argv[i];
+        config_len += snprintf(s.config + config_len, sizeof s.config - config_len, "%s%s", config_len ? " " : "", argv[i]);
+
+        if (config_len >= (int) sizeof s.config) {
+            config_len = sizeof s.config - 1;
+        }
+    }
+
+    bfoc_argv[bfoc_argc++] = "-o";
+    bfoc_argv[bfoc_argc++] = binary;
+    bfoc_argv[bfoc_argc++] = (char*) program;
+
+    if (!config_len) {
+        strcpy(s.config, "default");
+    }
+
+    snprintf(s.program, sizeof s.program, "%s", program);
+    current_revision(bfoc, s.revision, sizeof s.revision);
+    clean_field(s.config);
+    clean_field(s.program);
+
+    int status = run_timed(bfoc_argv, NULL, "/dev/null", &s.compile_time, NULL);
+    free(bfoc_argv);
+
+    struct stat st;
+
+    if (status || stat(binary, &st)) {
+        fprintf(stderr, "error: %s failed to compile %s\n", bfoc, program);
+        unlink(binary);
+        unlink(output);
+        return EXIT_FAILURE;
+    }
+
+    s.binary_size = st.st_size;
+
+    FILE* f = fopen(history, "a");
+
+    if (!f) {
+        fprintf(stderr, "error: couldn't open %s for appending: %s\n", history, strerror(errno));
+        unlink(binary);
+        unlink(output);
+        return EXIT_FAILURE;
+    }
+
+    if (!ftell(f)) {
+        fprintf(f, "revision,config,program,compile_s,binary_bytes,max_rss_kb,run_s\n");
+    }
+
+    char* run_argv[] = { binary, NULL };
+    double total = 0;
+
+    for (int run = 0; run < runs && !status; ++run) {
+        if ((status = run_timed(run_argv, input, output, &s.run_time, &s.max_rss))) {
+            fprintf(stderr, "error: %s failed on run %d (status %d)\n", program, run, status);
+            break;
+        }
+
+        fprintf(f, "%s,%s,%s,%.6f,%ld,%ld,%.6f\n", s.revision, s.config, s.program, s.compile_time, s.binary_size, s.max_rss, s.run_time);
+        total += s.run_time;
+    }
+
+    fclose(f);
+    unlink(binary);
+    unlink(output);
+
+    if (status) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%s [%s] at %s: compile %.3f s, %ld bytes, %ld KB RSS, mean run %.3f ms over %d runs\n",
+           s.program, s.config, s.revision, s.compile_time, s.binary_size, s.max_rss, 1000.0 * total / runs, runs);
+
+    return 0;
+}
+
+int bench_compare(int argc, char** argv) {
+    const char* history = DEFAULT_HISTORY;
+    struct sample* samples;
+    int opt, regressions = 0, compared = 0;
+
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        switch (opt) {
+        case 'f':
+            history = optarg;
+            break;
+        default:
+            return usage("bfbench");
+        }
+    }
+
+    if (argc - optind != 2) {
+        return usage("bfbench");
+    }
+
+    const char* base = argv[optind];
+    const char* head = argv[optind + 1];
+    int n = read_history(history, &samples);
+
+    if (n < 0) {
+        fprintf(stderr, "error: couldn't read history %s\n", history);
+        return EXIT_FAILURE;
+    }
+
+    /* Each program and configuration is reported once, at its first sample
+     * from the base revision. */
+    for (int i = 0; i < n; ++i) {
+        const struct sample* s = &samples[i];
+        int seen = 0;
+
+        if (strcmp(s->revision, base)) {
+            continue;
+        }
+
+        for (int j = 0; j < i && !seen; ++j) {
+            seen = !strcmp(samples[j].revision, base) && !strcmp(samples[j].program, s->program) && !strcmp(samples[j].config, s->config);
+        }
+
+        if (seen) {
+            continue;
+        }
+
+        struct stats a = summarize(samples, n, base, s, offsetof(struct sample, run_time));
+        struct stats b = summarize(samples, n, head, s, offsetof(struct sample, run_time));
+
+        if (a.n < 2 || b.n < 2) {
+            continue;
+        }
+
+        struct stats ca = summarize(samples, n, base, s, offsetof(struct sample, compile_time));
+        struct stats cb = summarize(samples, n, head, s, offsetof(struct sample, compile_time));
+
+        /* Welch's t interval for the difference of the mean run times. */
+        double se_a = a.var / a.n, se_b = b.var / b.n;
+        double se = sqrt(se_a + se_b);
+        double df = se > 0 ? (se_a + se_b) * (se_a + se_b) / (se_a * se_a / (a.n - 1) + se_b * se_b / (b.n - 1)) : a.n + b.n - 2;
+        double diff = b.mean - a.mean, margin = t_critical(df) * se;
+        const char* verdict = diff - margin > 0 ? "REGRESSION" : diff + margin < 0 ? "improvement" : "no change";
+
+        printf("%s [%s]: run %.3f -> %.3f ms (%+.1f%%, 95%% CI %+.3f..%+.3f ms), compile %.3f -> %.3f s: %s\n",
+               s->program, s->config, 1000.0 * a.mean, 1000.0 * b.mean, 100.0 * diff / a.mean,
+               1000.0 * (diff - margin), 1000.0 * (diff + margin), ca.mean, cb.mean, verdict);
+
+        ++compared;
+        regressions += diff - margin > 0;
+    }
+
+    free(samples);
+
+    if (!compared) {
+        fprintf(stderr, "error: no programs with at least two runs at both %s and %s\n", base, head);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d of %d benchmarks regressed\n", regressions, compared);
+    return regressions ? 1 : 0;
+}
+
+int run_timed(char** argv, const char* input, const char* output, double* elapsed, long* max_rss) {
+    struct timespec start, end;
+    struct rusage usage;
+    int child_status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t child = fork();
+
+    if (child < 0) {
+        fprintf(stderr, "error: couldn't start %s: %s\n", argv[0], strerror(errno));
+        return -1;
+    }
+
+    if (!child) {
+        int in = input ? open(input, O_RDONLY) : STDIN_FILENO;
+        int out = output ? open(output, O_WRONLY | O_TRUNC) : STDOUT_FILENO;
+
+        if (in < 0 || out < 0 || dup2(in, STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "error: child process: couldn't redirect %s: %s\n", argv[0], strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+
+        execvp(argv[0], argv);
+        fprintf(stderr, "error: child process: couldn't execute %s: %s\n", argv[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    wait4(child, &child_status, 0, &usage);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (max_rss) {
+        *max_rss = usage.ru_maxrss;
+    }
+
+    return child_status;
+}
+
+void current_revision(const char* bfoc, char* buf, int size) {
+    char dir[4096], command[4200];
+
+    snprintf(dir, sizeof dir, "%s", bfoc);
+    snprintf(command, sizeof command, "git -C '%s' describe --always --dirty 2>/dev/null", dirname(dir));
+
+    FILE* git = popen(command, "r");
+
+    if (!git || !fgets(buf, size, git)) {
+        snprintf(buf, size, "unknown");
+    }
+
+    if (git) {
+        pclose(git);
+    }
+
+    buf[strcspn(buf, "\n")] = 0;
+    clean_field(buf);
+}
+
+int read_history(const char* path, struct sample** samples) {
+    char line[4 * MAX_FIELD];
+    int n = 0, cap = 64;
+    FILE* f = fopen(path, "r");
+
+    if (!f) {
+        return -1;
+    }
+
+    *samples = malloc(sizeof(struct sample) * cap);
+
+    while (fgets(line, sizeof line, f)) {
+        struct sample s;
+
+        /* The header and malformed lines don't scan. */
+        if (sscanf(line, "%255[^,],%255[^,],%255[^,],%lf,%ld,%ld,%lf", s.revision, s.config, s.program,
+                   &s.compile_time, &s.binary_size, &s.max_rss, &s.run_time) != 7) {
+            continue;
+        }
+
+        if (n == cap) {
+            cap *= 2;
+            *samples = realloc(*samples, sizeof(struct sample) * cap);
+        }
+
+        (*samples)[n++] = s;
+    }
+
+    fclose(f);
+    return n;
+}
+
+struct stats summarize(const struct sample* samples, int n, const char* revision, const struct sample* ref, size_t field) {
+    struct stats st = { 0 };
+    double sum = 0, sum_sq = 0;
+
+    for (int i = 0; i < n; ++i) {
+        const struct sample* s = &samples[i];
+
+        if (strcmp(s->revision, revision) || strcmp(s->program, ref->program) || strcmp(s->config, ref->config)) {
+            continue;
+        }
+
+        double x = *(const double*) ((const char*) s + field);
+
+        sum += x;
+        sum_sq += x * x;
+        ++st.n;
+    }
+
+    if (st.n) {
+        st.mean = sum / st.n;
+    }
+
+    if (st.n > 1) {
+        st.var = (sum_sq - st.n * st.mean * st.mean) / (st.n - 1);
+        if (st.var < 0) st.var = 0;
+    }
+
+    return st;
+}
+
+double t_critical(double df) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+
+    int k = (int) df;
+
+    if (k < 1) {
+        return table[0];
+    }
+
+    return k <= 30 ? table[k - 1] : 1.960;
+}
+
+void clean_field(char* str) {
+    for (; *str; ++str) {
+        if (*str == ',' || *str == '\n') {
+            *str = ';';
+        }
+    }
+}
+
+int usage(const char* cmd) {
+    fprintf(stderr, "usage: %s run [-B <bfoc>] [-f <history>] [-i <input>] [-n <runs>] <program> [bfoc flags...]\n", cmd);
+    fprintf(stderr, "       %s compare [-f <history>] <base revision> <new revision>\n", cmd);
+    fprintf(stderr, "  -B <bfoc>    compiler to benchmark (default %s)\n", DEFAULT_BFOC);
+    fprintf(stderr, "  -f <history> results history (default %s)\n", DEFAULT_HISTORY);
+    fprintf(stderr, "  -i <input>   standard input for the program (default /dev/null)\n");
+    fprintf(stderr, "  -n <runs>    timed runs of the program (default %d)\n", DEFAULT_RUNS);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,345 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Microbenchmarks for the compiler's own phases. Generates synthetic
+ * programs of increasing size and times the reader, each optimizer pass
+ * and each code generator in isolation, reporting throughput in MB/s of
+ * source and millions of operations per second. Phases whose cost per
+ * byte grows with the input are flagged, as that is what accidentally
+ * quadratic code looks like.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bfoc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+#define MIN_SIZE      (1 << 14) /* Smallest synthetic program, in bytes */
+#define DEFAULT_MAX   (1 << 20) /* Default largest synthetic program, in bytes */
+#define REPEATS       3         /* Runs of each phase, the fastest counts */
+#define MAX_PHASES    16
+#define MAX_SIZES     16
+#define SUPERLINEAR   4.0       /* Growth in time per byte that flags a phase */
+
+/**
+ * A compiler phase under measurement.
+ */
+struct phase {
+    const char* name;
+    double per_byte[MAX_SIZES]; /* Seconds per source byte at each size */
+};
+
+static struct phase phases[MAX_PHASES];
+static int nphases;
+
+/**
+ * Fills a buffer with a synthetic brainfuck program. The program mixes the
+ * constructs the optimizer cares about: runs of updates and moves, clear,
+ * multiply and scan loops, nested loops and I/O. It starts by reading
+ * input so compile-time evaluation stops right away.
+ *
+ * Plain programs read no input, have no scan loops and keep the pointer
+ * near the start of the tape, so compile-time evaluation and the tape
+ * extent analysis have to go through all of them.
+ *
+ * @param buf   Buffer to fill, NUL-terminated
+ * @param size  Program length
+ * @param seed  Generator seed
+ * @param plain Nonzero for a plain program
+ */
+static void synthesize(char* buf, int size, unsigned seed, int plain);
+
+/**
+ * Runs the passes before compile-time evaluation on brainfuck source.
+ *
+ * @param source Brainfuck source, rewritten in place
+ * @param size   Source length
+ * @param prog   Program to write the IR to
+ */
+static void prepare(char* source, int size, struct bf_program* prog);
+
+/**
+ * Records the time a phase took on an input.
+ *
+ * @param name    Phase name
+ * @param size    Source size in bytes
+ * @param index   Size index
+ * @param elapsed Best time in seconds
+ * @param ops     Operations processed, 0 if not meaningful
+ */
+static void report(const char* name, int size, int index, double elapsed, int ops);
+
+/**
+ * Returns the current monotonic time in seconds.
+ */
+static double now(void);
+
+/**
+ * Copies a program in intermediate form.
+ *
+ * @param prog Program to copy
+ * @return     Independent copy
+ */
+static struct bf_program copy_program(const struct bf_program* prog);
+
+int main(int argc, char** argv) {
+    int max_size = argc > 1 ? atoi(argv[1]) : DEFAULT_MAX;
+    int nsizes = 0;
+
+    if (max_size < MIN_SIZE) {
+        fprintf(stderr, "usage: %s [max source bytes, at least %d]\n", *argv, MIN_SIZE);
+        return EXIT_FAILURE;
+    }
+
+    FILE* null = fopen("/dev/null", "w");
+
+    printf("%-10s %9s %10s %9s %9s\n", "phase", "bytes", "ms", "MB/s", "Mops/s");
+
+    for (int size = MIN_SIZE; size <= max_size && nsizes < MAX_SIZES; size *= 4, ++nsizes) {
+        char* source = malloc(size + 1);
+        char* work = malloc(size + 1);
+        struct bf_program prog, stage, plain;
+        double t, best;
+        int commands = 0;
+
+        synthesize(source, size, 1, 0);
+
+        for (int i = 0; i < size; ++i) {
+            commands += !!strchr("+-<>[].,", source[i]);
+        }
+
+        /* Reader: static optimization and parsing. */
+        best = 1e9;
+        for (int r = 0; r < REPEATS; ++r) {
+            memcpy(work, source, size + 1);
+            t = now();
+            bf_static_optimize(work, size);
+            t = now() - t;
+            if (t < best) best = t;
+        }
+        report("static", size, nsizes, best, commands);
+
+        best = 1e9;
+        for (int r = 0; r < REPEATS; ++r) {
+            if (r) bf_free(&prog);
+            t = now();
+            bf_parse(work, size, &prog);
+            t = now() - t;
+            if (t < best) best = t;
+        }
+        report("parse", size, nsizes, best, commands);
+
+        /* Optimizer passes, each timed on the output of the ones before.
+         * Evaluation stops at the first input here and is timed below. */
+        static void (*const passes[])(struct bf_program*) = {
+            bf_fold_blocks, bf_hoist_invariants, bf_convert_once_loops, bf_fold_blocks, bf_vectorize,
+        };
+        static const char* const pass_names[] = {
+            "fold", "hoist", "once", "refold", "vectorize",
+        };
+
+        for (int p = 0; p < (int) (sizeof passes / sizeof *passes); ++p) {
+            best = 1e9;
+
+            for (int r = 0; r < REPEATS; ++r) {
+                stage = copy_program(&prog);
+                t = now();
+                passes[p](&stage);
+                t = now() - t;
+                if (t < best) best = t;
+
+                if (r < REPEATS - 1) bf_free(&stage);
+            }
+
+            report(pass_names[p], size, nsizes, best, prog.len);
+            bf_free(&prog);
+            prog = stage;
+        }
+
+        /* Evaluation and the extent analysis, on a plain program of the
+         * same size they can't stop early on. */
+        synthesize(work, size, 1, 1);
+        prepare(work, size, &plain);
+
+        best = 1e9;
+        for (int r = 0; r < REPEATS; ++r) {
+            stage = copy_program(&plain);
+            t = now();
+            bf_evaluate_prefix(&stage, CODEGEN_TAPE_LENGTH);
+            t = now() - t;
+            if (t < best) best = t;
+            bf_free(&stage);
+        }
+        report("evaluate", size, nsizes, best, plain.len);
+
+        struct codegen_options opts = {
+            .tape_length = CODEGEN_TAPE_LENGTH,
+            .opt_level   = 3,
+        };
+
+        best = 1e9;
+        for (int r = 0; r < REPEATS; ++r) {
+            t = now();
+            bf_tape_extent(&plain, &opts.extent_min, &opts.extent_max);
+            t = now() - t;
+            if (t < best) best = t;
+        }
+        report("extent", size, nsizes, best, plain.len);
+        bf_free(&plain);
+
+        if (!bf_tape_extent(&prog, &opts.extent_min, &opts.extent_max)) {
+            opts.extent_known = 1;
+        }
+
+        /* Code generators, writing to /dev/null. */
+        best = 1e9;
+        for (int r = 0; r < REPEATS; ++r) {
+            t = now();
+            generate_c_prologue(&prog, &opts, null);
+            generate_c_source(&prog, &opts, null);
+            generate_c_epilogue(&opts, null);
+            t = now() - t;
+            if (t < best) best = t;
+        }
+        report("c", size, nsizes, best, prog.len);
+
+        best = 1e9;
+        for (int r = 0; r < REPEATS; ++r) {
+            t = now();
+            generate_llvm_source(&prog, &opts, null);
+            t = now() - t;
+            if (t < best) best = t;
+        }
+        report("llvm", size, nsizes, best, prog.len);
+
+#ifdef __x86_64__
+        best = 1e9;
+        for (int r = 0; r < REPEATS; ++r) {
+            t = now();
+            generate_asm_source(&prog, &opts, null);
+            t = now() - t;
+            if (t < best) best = t;
+        }
+        report("asm", size, nsizes, best, prog.len);
+#endif
+
+        bf_free(&prog);
+        free(source);
+        free(work);
+    }
+
+    fclose(null);
+
+    /* Linear phases keep a flat time per byte as inputs grow. */
+    int flagged = 0;
+
+    for (int p = 0; p < nphases && nsizes > 1; ++p) {
+        double first = phases[p].per_byte[0], last = phases[p].per_byte[nsizes - 1];
+
+        if (first > 0 && last / first > SUPERLINEAR) {
+            printf("warning: %s is superlinear, %.1fx the time per byte at %d bytes as at %d\n",
+                   phases[p].name, last / first, MIN_SIZE << (2 * (nsizes - 1)), MIN_SIZE);
+            ++flagged;
+        }
+    }
+
+    return flagged ? EXIT_FAILURE : 0;
+}
+
+void synthesize(char* buf, int size, unsigned seed, int plain) {
+    static const char* const pieces[] = {
+        "+++", "--", ">>", "<", "+", "-", ">", "<<",
+        "[-]", "[->+>++<<]", "[>+<-]", "[>[-]+<-]", "[-<+>]",
+        ".", ".", "[>]",
+    };
+    int len = 0, pos = 2;
+
+    if (plain) {
+        buf[len++] = '>';
+        buf[len++] = '>';
+    } else {
+        buf[len++] = ',';
+    }
+
+    while (len < size) {
+        seed = seed * 1103515245 + 12345;
+
+        const char* piece = pieces[(seed >> 16) % (sizeof pieces / sizeof *pieces)];
+        int n = strlen(piece), move = 0;
+
+        for (int i = 0; i < n; ++i) {
+            move += (piece[i] == '>') - (piece[i] == '<');
+        }
+
+        /* Plain programs skip scans and moves that would leave the
+         * cells near the start, which stay in reach of every piece. */
+        if (plain && (!strcmp(piece, "[>]") || pos + move < 2 || pos + move > 1024)) {
+            continue;
+        }
+
+        /* Pad the tail with updates, pieces can't be cut. */
+        if (len + n > size) {
+            piece = "+";
+            n = 1;
+            move = 0;
+        }
+
+        pos += move;
+
+        memcpy(buf + len, piece, n);
+        len += n;
+    }
+
+    buf[len] = 0;
+}
+
+void report(const char* name, int size, int index, double elapsed, int ops) {
+    int p = 0;
+
+    while (p < nphases && strcmp(phases[p].name, name)) ++p;
+
+    if (p == nphases && nphases < MAX_PHASES) {
+        phases[nphases++].name = name;
+    }
+
+    if (p < MAX_PHASES) {
+        phases[p].per_byte[index] = elapsed / size;
+    }
+
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+
+    printf("%-10s %9d %10.3f %9.1f %9.1f\n", name, size, elapsed * 1000.0, size / elapsed / 1e6, ops / elapsed / 1e6);
+}
+
+void prepare(char* source, int size, struct bf_program* prog) {
+    bf_static_optimize(source, size);
+    bf_parse(source, size, prog);
+    bf_fold_blocks(prog);
+    bf_hoist_invariants(prog);
+    bf_convert_once_loops(prog);
+}
+
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct bf_program copy_program(const struct bf_program* prog) {
+    struct bf_program copy = *prog;
+
+    copy.ops = malloc(sizeof(struct bf_op) * (prog->cap ? prog->cap : 1));
+    copy.vecs = malloc(sizeof(struct bf_vec) * (prog->vecs_cap ? prog->vecs_cap : 1));
+    memcpy(copy.ops, prog->ops, sizeof(struct bf_op) * prog->len);
+    memcpy(copy.vecs, prog->vecs, sizeof(struct bf_vec) * prog->vecs_len);
+
+    return copy;
+}
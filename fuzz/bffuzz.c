@@ -0,0 +1,446 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Fuzzing harness for the compiler. Each input is a brainfuck program,
+ * optionally followed by a '!' and the bytes it reads. The program goes
+ * through bfoc's own reader and optimizer pipeline under each of
+ * fuzz_configs[] and through the code generators. Then the optimized
+ * program, or for the brainfuck backend its output, is interpreted and
+ * its output compared with a plain interpretation of the source. Crashes,
+ * compile times past FUZZ_COMPILE_LIMIT and divergent output all abort.
+ * The compiler's own messages go to stderr as usual.
+ *
+ * Built with -DBFOC_LIBFUZZER this is a libFuzzer target. Otherwise it
+ * runs each file named on the command line, or stdin, which suits AFL and
+ * replaying crashes.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bfoc.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+#define FUZZ_STEP_LIMIT    (1L << 20) /* Source commands run by the reference */
+#define FUZZ_TAPE_CAPACITY (1 << 15)  /* Tape cells, enough for a rounded circular tape */
+#define FUZZ_OUTPUT_LIMIT  (1 << 12)  /* Output bytes compared */
+#define FUZZ_COMPILE_LIMIT 1.0        /* Seconds the compiler may take on one input */
+
+/**
+ * How an interpretation ended.
+ */
+enum run_status {
+    RUN_OK,     /* Program finished */
+    RUN_LIMIT,  /* Step or output limit reached */
+    RUN_BOUNDS, /* Pointer left the tape, behaviour is undefined */
+    RUN_FAULT,  /* Malformed program */
+};
+
+/**
+ * Interpretation state shared by the reference and optimized runs.
+ */
+struct run {
+    unsigned char tape[FUZZ_TAPE_CAPACITY];
+    int length;      /* Cells in use */
+    int wrap;        /* The tape is circular, length is a power of two */
+    long step_limit; /* Steps before the run is cut short */
+    int pos;
+    const uint8_t* input;
+    size_t input_len;
+    unsigned char output[FUZZ_OUTPUT_LIMIT];
+    int output_len;
+};
+
+/* Options each input is compiled under: the default build, a circular
+ * tape, and the brainfuck backend, which optimizes without hoisting. */
+static const struct codegen_options fuzz_configs[] = {
+    { .tape_length = CODEGEN_TAPE_LENGTH, .opt_level = 3 },
+    { .tape_length = CODEGEN_TAPE_LENGTH, .opt_level = 3, .wrap = 1 },
+    { .tape_length = CODEGEN_TAPE_LENGTH, .opt_level = 3, .backend = BACKEND_BF },
+};
+
+/**
+ * Runs one input through the compiler and checks the result.
+ *
+ * @param data Program, then optionally '!' and its input
+ * @param size Input length
+ */
+static void fuzz_one(const uint8_t* data, size_t size);
+
+/**
+ * Interprets brainfuck source directly, command by command.
+ *
+ * @param source Program source
+ * @param len    Source length
+ * @param run    State to run in, with input set
+ * @return       How the run ended
+ */
+static enum run_status run_source(const char* source, int len, struct run* run);
+
+/**
+ * Interprets a program in intermediate form.
+ *
+ * @param prog Program to run
+ * @param run  State to run in, with input set
+ * @return     How the run ended
+ */
+static enum run_status run_program(const struct bf_program* prog, struct run* run);
+
+/**
+ * Maps a cell position to its tape index, wrapping on a circular tape.
+ *
+ * @param run  Run state
+ * @param cell Cell position
+ * @return     Tape index, or -1 if the position is off the tape
+ */
+static int run_index(const struct run* run, int cell);
+
+/**
+ * Reads the next input byte, as getchar() does in compiled programs.
+ *
+ * @param run Run state
+ * @return    Next byte, or EOF truncated to a cell
+ */
+static unsigned char run_input(struct run* run);
+
+/**
+ * Returns the current monotonic time in seconds.
+ */
+static double now(void);
+
+#ifdef BFOC_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    fuzz_one(data, size);
+    return 0;
+}
+#else
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc || i == 1; ++i) {
+        FILE* in = argc > 1 ? fopen(argv[i], "rb") : stdin;
+        uint8_t* data = NULL;
+        size_t size = 0, cap = 0, n;
+
+        if (!in) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        do {
+            if (size == cap) {
+                uint8_t* grown = realloc(data, cap ? cap * 2 : 4096);
+
+                if (!grown) {
+                    fprintf(stderr, "bffuzz: out of memory reading %s\n", argc > 1 ? argv[i] : "stdin");
+                    return EXIT_FAILURE;
+                }
+
+                data = grown;
+                cap = cap ? cap * 2 : 4096;
+            }
+
+            n = fread(data + size, 1, cap - size, in);
+            size += n;
+        } while (n);
+
+        if (in != stdin) {
+            fclose(in);
+        }
+
+        fuzz_one(data, size);
+        free(data);
+    }
+
+    return 0;
+}
+#endif
+
+void fuzz_one(const uint8_t* data, size_t size) {
+    static struct run reference, optimized;
+    const uint8_t* split = memchr(data, '!', size);
+    size_t len = split ? (size_t) (split - data) : size;
+    char* source;
+    int source_len;
+
+    /* An empty program has nothing to compile. */
+    if (!len) {
+        return;
+    }
+
+    /* The program comes through bfoc's own reader. */
+    FILE* in = fmemopen((void*) data, len, "rb");
+
+    if (!in || bf_read_source(in, &source, &source_len)) {
+        fprintf(stderr, "bffuzz: couldn't read the program\n");
+        abort();
+    }
+
+    fclose(in);
+
+    for (int c = 0; c < (int) (sizeof fuzz_configs / sizeof *fuzz_configs); ++c) {
+        struct codegen_options opts = fuzz_configs[c];
+        struct bf_program prog;
+        enum run_status status;
+
+        double start = now();
+        int failed = bf_optimize_source(source, source_len, &opts, &prog);
+        double elapsed = now() - start;
+
+        /* The reference runs on the tape the program was compiled for,
+         * rounded up if circular. The optimized program may use more
+         * steps than the source, setting up evaluated cells one at a
+         * time. */
+        memset(&reference, 0, sizeof reference);
+        reference.length = opts.tape_length;
+        reference.wrap = opts.wrap;
+        reference.step_limit = FUZZ_STEP_LIMIT;
+        reference.input = split ? split + 1 : NULL;
+        reference.input_len = split ? size - len - 1 : 0;
+        optimized = reference;
+        optimized.step_limit = 4 * FUZZ_STEP_LIMIT + 256L * CODEGEN_TAPE_LENGTH;
+
+        enum run_status expected = run_source(source, source_len, &reference);
+
+        if (failed) {
+            if (expected != RUN_FAULT) {
+                fprintf(stderr, "bffuzz: a valid program failed to parse\n");
+                abort();
+            }
+
+            break;
+        }
+
+        if (expected == RUN_FAULT) {
+            fprintf(stderr, "bffuzz: a program with unbalanced loops parsed\n");
+            abort();
+        }
+
+        if (elapsed > FUZZ_COMPILE_LIMIT) {
+            fprintf(stderr, "bffuzz: compiling %d bytes took %.2fs\n", source_len, elapsed);
+            abort();
+        }
+
+        if (opts.backend == BACKEND_BF) {
+            /* The brainfuck output is checked by running it. */
+            char* text = NULL;
+            size_t text_len = 0;
+            FILE* out = open_memstream(&text, &text_len);
+
+            if (!out || generate_bf_source(&prog, &opts, out)) {
+                fprintf(stderr, "bffuzz: the brainfuck backend failed\n");
+                abort();
+            }
+
+            fclose(out);
+            status = expected == RUN_OK ? run_source(text, text_len, &optimized) : RUN_OK;
+            free(text);
+        } else {
+            /* Code generators are run for crashes only, their output is
+             * dropped. */
+            FILE* null = fopen("/dev/null", "w");
+
+            if (null) {
+                generate_c_prologue(&prog, &opts, null);
+                generate_c_source(&prog, &opts, null);
+                generate_c_epilogue(&opts, null);
+                generate_llvm_source(&prog, &opts, null);
+#ifdef __x86_64__
+                generate_asm_source(&prog, &opts, null);
+#endif
+                fclose(null);
+            }
+
+            status = expected == RUN_OK ? run_program(&prog, &optimized) : RUN_OK;
+        }
+
+        /* Runs that are undefined or cut short have nothing to compare. */
+        if (expected == RUN_OK && (status != RUN_OK || optimized.output_len != reference.output_len
+                                   || memcmp(optimized.output, reference.output, reference.output_len))) {
+            fprintf(stderr, "bffuzz: optimized program diverged under fuzz_configs[%d] (status %d, %d bytes of output, expected %d)\n",
+                    c, status, optimized.output_len, reference.output_len);
+            abort();
+        }
+
+        bf_free(&prog);
+    }
+
+    free(source);
+}
+
+enum run_status run_source(const char* source, int len, struct run* run) {
+    int* match = malloc(sizeof(int) * (len + 1));
+    int* stack = malloc(sizeof(int) * (len + 1));
+    int depth = 0;
+    enum run_status status = RUN_OK;
+
+    for (int i = 0; i < len; ++i) {
+        if (source[i] == '[') {
+            stack[depth++] = i;
+        } else if (source[i] == ']') {
+            if (!depth) {
+                status = RUN_FAULT;
+                break;
+            }
+
+            match[i] = stack[--depth];
+            match[match[i]] = i;
+        }
+    }
+
+    if (depth) {
+        status = RUN_FAULT;
+    }
+
+    long steps = 0;
+
+    for (int i = 0; i < len && status == RUN_OK; ++i) {
+        unsigned char* cell = &run->tape[run->pos];
+
+        if (++steps > run->step_limit) {
+            status = RUN_LIMIT;
+            break;
+        }
+
+        switch (source[i]) {
+        case '+': ++*cell; break;
+        case '-': --*cell; break;
+        case '>':
+        case '<':
+            run->pos = run_index(run, run->pos + (source[i] == '>' ? 1 : -1));
+            if (run->pos < 0) status = RUN_BOUNDS;
+            break;
+        case '.':
+            if (run->output_len == FUZZ_OUTPUT_LIMIT) status = RUN_LIMIT;
+            else run->output[run->output_len++] = *cell;
+            break;
+        case ',': *cell = run_input(run); break;
+        case '[': if (!*cell) i = match[i]; break;
+        case ']': if (*cell) i = match[i]; break;
+        default: break;
+        }
+    }
+
+    free(match);
+    free(stack);
+
+    return status;
+}
+
+enum run_status run_program(const struct bf_program* prog, struct run* run) {
+    long steps = 0;
+
+    for (int ip = 0; ip < prog->len;) {
+        const struct bf_op* op = &prog->ops[ip];
+        int cell = run_index(run, run->pos + (op->type == BF_OP_END ? prog->ops[op->match].offset : op->offset));
+        int src = run_index(run, run->pos + op->src);
+
+        if (++steps > run->step_limit) {
+            return RUN_LIMIT;
+        }
+
+        if (op->type == BF_OP_MOVE) {
+            if ((run->pos = run_index(run, run->pos + op->arg)) < 0) {
+                return RUN_BOUNDS;
+            }
+
+            ++ip;
+            continue;
+        }
+
+        if (op->type == BF_OP_MUL && src < 0) {
+            return RUN_BOUNDS;
+        }
+
+        /* Multiplying by zero leaves the target alone wherever it is, the
+         * loop it came from wouldn't have run. */
+        if (op->type == BF_OP_MUL && !run->tape[src]) {
+            ++ip;
+            continue;
+        }
+
+        if (cell < 0) {
+            return RUN_BOUNDS;
+        }
+
+        switch (op->type) {
+        case BF_OP_ADD:
+            run->tape[cell] += op->arg;
+            break;
+        case BF_OP_SET:
+            run->tape[cell] = op->arg;
+            break;
+        case BF_OP_MUL:
+            run->tape[cell] += run->tape[src] * op->arg;
+            break;
+        case BF_OP_VEC:
+            for (int lane = 0; lane < op->arg; ++lane) {
+                const struct bf_vec* vec = &prog->vecs[op->match];
+                int index = run_index(run, run->pos + op->offset + lane);
+
+                if (index < 0) {
+                    return RUN_BOUNDS;
+                }
+
+                run->tape[index] = (run->tape[index] & vec->mask[lane]) + vec->add[lane];
+            }
+            break;
+        case BF_OP_OUTPUT:
+            if (run->output_len == FUZZ_OUTPUT_LIMIT) {
+                return RUN_LIMIT;
+            }
+
+            run->output[run->output_len++] = run->tape[cell];
+            break;
+        case BF_OP_INPUT:
+            run->tape[cell] = run_input(run);
+            break;
+        case BF_OP_LOOP:
+        case BF_OP_IF:
+            if (!run->tape[cell]) {
+                ip = op->match + 1;
+                continue;
+            }
+            break;
+        case BF_OP_END:
+            if (run->tape[cell]) {
+                ip = op->match + 1;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        ++ip;
+    }
+
+    return RUN_OK;
+}
+
+int run_index(const struct run* run, int cell) {
+    if (run->wrap) {
+        return cell & (run->length - 1);
+    }
+
+    return cell < 0 || cell >= run->length ? -1 : cell;
+}
+
+unsigned char run_input(struct run* run) {
+    if (!run->input_len) {
+        return (unsigned char) EOF;
+    }
+
+    --run->input_len;
+    return *run->input++;
+}
+
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
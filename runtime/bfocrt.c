@@ -0,0 +1,142 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Runtime support library for generated programs, hosted on libc.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bfocrt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static char output_buffer[BFRT_OUTPUT_BUFFER];
+
+static struct {
+    const char* path;
+    const uint64_t* reads;
+    const uint64_t* writes;
+    const long* min;
+    const long* max;
+    long origin;
+} heatmap;
+
+static struct {
+    const char* path;
+    const uint64_t (*counts)[2];
+    long sites;
+} profile;
+
+/**
+ * Writes the registered heatmap, along with the number of distinct cache
+ * lines and pages the program touched.
+ */
+static void heatmap_dump(void);
+
+/**
+ * Writes the registered branch profile.
+ */
+static void profile_dump(void);
+
+void bfrt_heatmap(const char* path, const uint64_t* reads, const uint64_t* writes, const long* min, const long* max, long origin) {
+    heatmap.path = path;
+    heatmap.reads = reads;
+    heatmap.writes = writes;
+    heatmap.min = min;
+    heatmap.max = max;
+    heatmap.origin = origin;
+
+    atexit(heatmap_dump);
+}
+
+void bfrt_profile(const char* path, const uint64_t (*counts)[2], long sites) {
+    profile.path = path;
+    profile.counts = counts;
+    profile.sites = sites;
+
+    atexit(profile_dump);
+}
+
+void bfrt_out_of_steps(void) {
+    fflush(stdout);
+    fputs("bfrt: step limit exceeded\n", stderr);
+    exit(BFRT_STEP_LIMIT_STATUS);
+}
+
+void bfrt_prefault(volatile void* mem, size_t len, int lock) {
+    /* Writing rather than reading, a read would only map the shared zero
+     * page and the first write would fault again. */
+    for (size_t i = 0; i < len; i += 4096) {
+        ((volatile char*) mem)[i] = 0;
+    }
+
+    if (lock && mlock((void*) mem, len)) {
+        perror("mlock");
+    }
+}
+
+void bfrt_prefault_output(int lock) {
+    /* Keep stdio's choice of line buffering for terminals. */
+    setvbuf(stdout, output_buffer, isatty(1) ? _IOLBF : _IOFBF, sizeof output_buffer);
+    bfrt_prefault(output_buffer, sizeof output_buffer, lock);
+}
+
+void heatmap_dump(void) {
+    long lo = *heatmap.min, hi = *heatmap.max;
+    long lines = 0, last_line = -1, pages = 0, last_page = -1;
+    uint64_t peak = 1;
+    FILE* f = fopen(heatmap.path, "w");
+
+    if (!f) {
+        perror(heatmap.path);
+        return;
+    }
+
+    for (long i = lo; i <= hi; ++i) {
+        uint64_t total = heatmap.reads[i] + heatmap.writes[i];
+
+        if (!total) continue;
+        if (total > peak) peak = total;
+        if (i / 64 != last_line) ++lines, last_line = i / 64;
+        if (i / 4096 != last_page) ++pages, last_page = i / 4096;
+    }
+
+    fprintf(f, "# bfoc tape heatmap\n");
+    fprintf(f, "# extent: %ld..%ld (%ld cells, %ld cache lines, %ld pages touched)\n", lo - heatmap.origin, hi - heatmap.origin, hi - lo + 1, lines, pages);
+    fprintf(f, "# cell reads writes\n");
+
+    for (long i = lo; i <= hi; ++i) {
+        uint64_t total = heatmap.reads[i] + heatmap.writes[i];
+        int bar = total ? 1 + (int) (39 * total / peak) : 0;
+
+        fprintf(f, "%ld %llu %llu ", i - heatmap.origin, (unsigned long long) heatmap.reads[i], (unsigned long long) heatmap.writes[i]);
+        while (bar--) fputc('#', f);
+        fputc('\n', f);
+    }
+
+    fclose(f);
+}
+
+void profile_dump(void) {
+    FILE* f = fopen(profile.path, "w");
+
+    if (!f) {
+        perror(profile.path);
+        return;
+    }
+
+    fprintf(f, "# bfoc branch profile\n");
+    fprintf(f, "# sites: %ld\n", profile.sites);
+    fprintf(f, "# site tests taken\n");
+
+    for (long i = 0; i < profile.sites; ++i) {
+        fprintf(f, "%ld %llu %llu\n", i, (unsigned long long) profile.counts[i][0], (unsigned long long) profile.counts[i][1]);
+    }
+
+    fclose(f);
+}
@@ -0,0 +1,64 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Runtime support library interface. Generated programs don't include this
+ * header, the code generator emits matching declarations instead so gcc has
+ * no system headers to parse. Keep the two in sync.
+ */
+
+#ifndef BFOCRT_H
+#define BFOCRT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BFRT_OUTPUT_BUFFER     65536 /* Output buffer size */
+#define BFRT_STEP_LIMIT_STATUS 124   /* Exit status once the step budget runs out, as timeout(1) */
+#define BFRT_REPLAY_STATUS     125   /* Exit status when a replay fails or its output differs */
+
+/**
+ * Registers a tape heatmap to be written out when the program exits.
+ *
+ * @param path   Heatmap output path
+ * @param reads  Per-cell read counters
+ * @param writes Per-cell write counters
+ * @param min    Lowest tape index the pointer reached
+ * @param max    Highest tape index the pointer reached
+ * @param origin Tape index of the starting cell
+ */
+void bfrt_heatmap(const char* path, const uint64_t* reads, const uint64_t* writes, const long* min, const long* max, long origin);
+
+/**
+ * Registers a branch profile to be written out when the program exits.
+ *
+ * @param path   Profile output path
+ * @param counts Test and taken counters of each branch site
+ * @param sites  Number of branch sites
+ */
+void bfrt_profile(const char* path, const uint64_t (*counts)[2], long sites);
+
+/**
+ * Reports that the program ran out of its step budget, flushes its output
+ * and exits with BFRT_STEP_LIMIT_STATUS.
+ */
+__attribute__((noreturn)) void bfrt_out_of_steps(void);
+
+/**
+ * Faults in every page of a memory region and optionally locks it.
+ *
+ * @param mem  Start of the region
+ * @param len  Region length in bytes
+ * @param lock Nonzero to lock the region into memory
+ */
+void bfrt_prefault(volatile void* mem, size_t len, int lock);
+
+/**
+ * Faults in (and optionally locks) the output buffer, installing a static
+ * one first where the runtime doesn't already own it.
+ *
+ * @param lock Nonzero to lock the buffer into memory
+ */
+void bfrt_prefault_output(int lock);
+
+#endif
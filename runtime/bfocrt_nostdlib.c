@@ -0,0 +1,158 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Runtime support library for -r nostdlib. Programs get their own _start,
+ * buffered putchar() and getchar() and talk to the kernel through raw
+ * syscalls, so they link statically without libc and start without a
+ * dynamic loader or stdio initialization. Output is flushed when the
+ * buffer fills, before blocking on input and at exit.
+ */
+
+#include "bfocrt.h"
+
+#if defined(__x86_64__)
+#define SYS_READ       0
+#define SYS_WRITE      1
+#define SYS_MLOCK      149
+#define SYS_EXIT_GROUP 231
+__asm__(".text\n.globl _start\n_start:\n\txor %ebp, %ebp\n\tand $-16, %rsp\n\tcall bfrt_start\n\thlt\n");
+#elif defined(__aarch64__)
+#define SYS_READ       63
+#define SYS_WRITE      64
+#define SYS_MLOCK      228
+#define SYS_EXIT_GROUP 94
+__asm__(".text\n.globl _start\n_start:\n\tmov x29, #0\n\tmov x30, #0\n\tbl bfrt_start\n");
+#else
+#error "the nostdlib runtime supports x86-64 and aarch64 only"
+#endif
+
+#define INPUT_BUFFER 4096
+
+static unsigned char output_buffer[BFRT_OUTPUT_BUFFER], input_buffer[INPUT_BUFFER];
+static size_t output_len, input_pos, input_len;
+
+int main(void);
+int putchar(int c);
+int getchar(void);
+void* memset(void* dst, int c, size_t n);
+void* memcpy(void* dst, const void* src, size_t n);
+
+/**
+ * Program entry point, called from _start with an aligned stack.
+ */
+__attribute__((noreturn, used)) void bfrt_start(void);
+
+/**
+ * Performs a raw system call with up to three arguments.
+ *
+ * @param n System call number
+ * @return  System call result, negative errno on failure
+ */
+static long bfrt_syscall(long n, long a, long b, long c);
+
+/**
+ * Writes out any buffered output.
+ */
+static void bfrt_flush(void);
+
+void bfrt_start(void) {
+    int status = main();
+
+    bfrt_flush();
+    bfrt_syscall(SYS_EXIT_GROUP, status, 0, 0);
+
+    for (;;);
+}
+
+int putchar(int c) {
+    if (output_len == sizeof output_buffer) {
+        bfrt_flush();
+    }
+
+    output_buffer[output_len++] = c;
+    return (unsigned char) c;
+}
+
+int getchar(void) {
+    if (input_pos == input_len) {
+        long n;
+
+        bfrt_flush();
+        n = bfrt_syscall(SYS_READ, 0, (long) input_buffer, sizeof input_buffer);
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        input_pos = 0;
+        input_len = n;
+    }
+
+    return input_buffer[input_pos++];
+}
+
+void bfrt_out_of_steps(void) {
+    bfrt_flush();
+    bfrt_syscall(SYS_WRITE, 2, (long) "bfrt: step limit exceeded\n", 26);
+    bfrt_syscall(SYS_EXIT_GROUP, BFRT_STEP_LIMIT_STATUS, 0, 0);
+
+    for (;;);
+}
+
+void bfrt_prefault(volatile void* mem, size_t len, int lock) {
+    for (size_t i = 0; i < len; i += 4096) {
+        ((volatile char*) mem)[i] = 0;
+    }
+
+    if (lock && bfrt_syscall(SYS_MLOCK, (long) mem, len, 0)) {
+        bfrt_syscall(SYS_WRITE, 2, (long) "mlock failed\n", 13);
+    }
+}
+
+void bfrt_prefault_output(int lock) {
+    bfrt_prefault(output_buffer, sizeof output_buffer, lock);
+}
+
+/* gcc may emit calls to these even in freestanding code. */
+void* memset(void* dst, int c, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        ((unsigned char*) dst)[i] = c;
+    }
+
+    return dst;
+}
+
+void* memcpy(void* dst, const void* src, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        ((unsigned char*) dst)[i] = ((const unsigned char*) src)[i];
+    }
+
+    return dst;
+}
+
+long bfrt_syscall(long n, long a, long b, long c) {
+#if defined(__x86_64__)
+    long ret;
+    __asm__ volatile ("syscall" : "=a"(ret) : "a"(n), "D"(a), "S"(b), "d"(c) : "rcx", "r11", "memory");
+    return ret;
+#else
+    register long x8 __asm__("x8") = n, x0 __asm__("x0") = a, x1 __asm__("x1") = b, x2 __asm__("x2") = c;
+    __asm__ volatile ("svc #0" : "+r"(x0) : "r"(x8), "r"(x1), "r"(x2) : "memory");
+    return x0;
+#endif
+}
+
+void bfrt_flush(void) {
+    for (size_t done = 0; done < output_len;) {
+        long n = bfrt_syscall(SYS_WRITE, 1, (long) (output_buffer + done), output_len - done);
+
+        if (n <= 0) {
+            break;
+        }
+
+        done += n;
+    }
+
+    output_len = 0;
+}
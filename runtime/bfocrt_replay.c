@@ -0,0 +1,187 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * I/O record and replay layer for -r replay. Programs link this ahead of
+ * the libc runtime, so its putchar() and getchar() take the place of
+ * libc's. With BFRT_RECORD set, the input read and output written are
+ * saved to the named log at exit. With BFRT_REPLAY set, input is served
+ * from the named log in memory and output is checked against it instead of
+ * being written, so runs repeat exactly without I/O timing noise. Without
+ * either, I/O passes straight through to stdio.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bfocrt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#define LOG_MAGIC "bfrt-io 1\n"
+
+/**
+ * A growable byte buffer.
+ */
+struct io_buffer {
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+};
+
+static enum { IO_PASS, IO_RECORD, IO_REPLAY } mode;
+static const char* log_path;
+static struct io_buffer input, output;
+static size_t input_pos, output_pos, mismatch = (size_t) -1;
+
+/**
+ * Selects the I/O mode from the environment before main() runs, and loads
+ * the log to replay.
+ */
+__attribute__((constructor)) static void io_init(void);
+
+/**
+ * Writes the recording, or checks the replayed output was complete.
+ */
+static void io_finish(void);
+
+/**
+ * Appends a byte to a buffer.
+ *
+ * @param buf  Buffer to append to
+ * @param byte Byte to append
+ */
+static void io_append(struct io_buffer* buf, unsigned char byte);
+
+/**
+ * Reads one section of a log into a buffer.
+ *
+ * @param f    Log being read
+ * @param name Expected section name
+ * @param buf  Buffer to fill
+ * @return     0 on success, -1 if the log is malformed
+ */
+static int read_section(FILE* f, const char* name, struct io_buffer* buf);
+
+int putchar(int c) {
+    switch (mode) {
+    case IO_REPLAY:
+        if (mismatch == (size_t) -1 && (output_pos == output.len || output.data[output_pos] != (unsigned char) c)) {
+            mismatch = output_pos;
+        }
+
+        ++output_pos;
+        return (unsigned char) c;
+    case IO_RECORD:
+        io_append(&output, c);
+        /* fallthrough */
+    default:
+        return fputc(c, stdout);
+    }
+}
+
+int getchar(void) {
+    int c;
+
+    switch (mode) {
+    case IO_REPLAY:
+        return input_pos < input.len ? input.data[input_pos++] : EOF;
+    case IO_RECORD:
+        /* Output is flushed before blocking, as stdin reads would. */
+        fflush(stdout);
+        c = fgetc(stdin);
+
+        if (c != EOF) {
+            io_append(&input, c);
+        }
+
+        return c;
+    default:
+        return fgetc(stdin);
+    }
+}
+
+void io_init(void) {
+    if ((log_path = getenv("BFRT_REPLAY"))) {
+        FILE* f = fopen(log_path, "rb");
+        char magic[sizeof LOG_MAGIC];
+
+        if (!f) {
+            perror(log_path);
+            exit(BFRT_REPLAY_STATUS);
+        }
+
+        if (!fgets(magic, sizeof magic, f) || strcmp(magic, LOG_MAGIC) || read_section(f, "input", &input) || read_section(f, "output", &output)) {
+            fprintf(stderr, "bfrt: %s is not an I/O log\n", log_path);
+            exit(BFRT_REPLAY_STATUS);
+        }
+
+        fclose(f);
+        mode = IO_REPLAY;
+    } else if ((log_path = getenv("BFRT_RECORD"))) {
+        mode = IO_RECORD;
+    } else {
+        return;
+    }
+
+    atexit(io_finish);
+}
+
+void io_finish(void) {
+    if (mode == IO_REPLAY) {
+        if (mismatch == (size_t) -1 && output_pos != output.len) {
+            mismatch = output_pos;
+        }
+
+        if (mismatch != (size_t) -1) {
+            fprintf(stderr, "bfrt: output differs from the recording at byte %zu\n", mismatch);
+            _exit(BFRT_REPLAY_STATUS);
+        }
+
+        return;
+    }
+
+    FILE* f = fopen(log_path, "wb");
+
+    if (!f) {
+        perror(log_path);
+        return;
+    }
+
+    fprintf(f, "%sinput %zu\n", LOG_MAGIC, input.len);
+    fwrite(input.data, 1, input.len, f);
+    fprintf(f, "\noutput %zu\n", output.len);
+    fwrite(output.data, 1, output.len, f);
+    fprintf(f, "\n");
+
+    if (fclose(f)) {
+        perror(log_path);
+    }
+}
+
+void io_append(struct io_buffer* buf, unsigned char byte) {
+    if (buf->len == buf->cap) {
+        buf->cap = buf->cap ? buf->cap * 2 : 4096;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+
+    buf->data[buf->len++] = byte;
+}
+
+int read_section(FILE* f, const char* name, struct io_buffer* buf) {
+    char header[64], expected[64];
+    size_t len;
+
+    if (!fgets(header, sizeof header, f) || sscanf(header, "%63s %zu", expected, &len) != 2 || strcmp(expected, name)) {
+        return -1;
+    }
+
+    buf->data = malloc(len + 1);
+    buf->len = buf->cap = len;
+
+    /* Each section ends with a newline after its bytes. */
+    return fread(buf->data, 1, len, f) == len && fgetc(f) == '\n' ? 0 : -1;
+}
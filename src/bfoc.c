@@ -17,46 +17,226 @@
 
 #include <errno.h>
 #include <stdlib.h>
-#include <stdio.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "bfoc.h"
+
 #define GCC_EXECUTABLE      "gcc"
-#define CODEGEN_TAPE_LENGTH 30000 /* https://en.wikipedia.org/wiki/Brainfuck#Language_design */
-#define INITIAL_INPUT_BUF   256
+#define CLANG_EXECUTABLE    "clang"
+#define OPT_EXECUTABLE      "opt"
+#define LLC_EXECUTABLE      "llc"
+#define AS_EXECUTABLE       "as"
+#define TUNE_RUNS           3
+
+/* Directory holding the prebuilt runtime libraries, overridden at run time
+ * by BFOC_RUNTIME_DIR. The makefile points this at the build tree. */
+#ifndef BFOC_RUNTIME_DIR
+#define BFOC_RUNTIME_DIR    "/usr/local/lib/bfoc"
+#endif
+
+/* Configurations tried by the autotuner. Only the tuning knobs and the
+ * backend are taken from these, the first one is the default build. */
+static const struct codegen_options tune_configs[] = {
+    { .backend = BACKEND_C,    .opt_level = 3 },
+    { .backend = BACKEND_C,    .opt_level = 2 },
+    { .backend = BACKEND_C,    .opt_level = 3, .native = 1 },
+    { .backend = BACKEND_C,    .opt_level = 3, .no_cell_cache = 1 },
+    { .backend = BACKEND_C,    .opt_level = 3, .no_vectorize = 1 },
+    { .backend = BACKEND_C,    .opt_level = 3, .native = 1, .no_vectorize = 1 },
+    { .backend = BACKEND_LLVM, .opt_level = 3 },
+    { .backend = BACKEND_LLVM, .opt_level = 3, .native = 1 },
+#ifdef __x86_64__
+    { .backend = BACKEND_ASM,  .opt_level = 3 },
+#endif
+#ifdef BFOC_GCCJIT
+    { .backend = BACKEND_GCCJIT, .opt_level = 3 },
+#endif
+};
 
 /**
- * Generates a C function body from a brainfuck input source.
- * Writes the generated C source code to <out>.
+ * Outputs program usage to stderr.
  *
- * @param input_buf Brainfuck source buffer
- * @param input_len Brainfuck source length
- * @param out       File to write generated code to
+ * @param cmd First command line argument passed to main (argv[0])
+ * @return    EXIT_FAILURE
+ */
+static int usage(char* cmd);
+
+/**
+ * Builds and times the program under each of tune_configs[] with a
+ * representative input, and applies the fastest configuration to <opts>.
+ * Configurations which fail to build or run, or which produce different
+ * output from the others, are skipped.
  *
- * @return 0 if generation was successful, -1 if an error occurred
+ * @param source Brainfuck source, NUL-terminated
+ * @param len    Source length
+ * @param opts   Code generation options
+ * @param input  Path of the input to run the program on
+ * @return       0 on success, -1 if no configuration could be timed
  */
-static int generate_c_source(char* input_buf, int input_len, FILE* out);
+static int autotune(const char* source, int len, struct codegen_options* opts, const char* input);
 
 /**
- * Statically optimizes brainfuck source code. Modifies the buffer in-place.
+ * Runs a compiled program TUNE_RUNS times and returns its best wall time.
  *
- * @param input_buf Brainfuck source buffer
- * @param input_len Brainfuck source length
+ * @param binary Program path
+ * @param input  Path of the file to use as standard input
+ * @param output Path of the file to write standard output to
+ * @return       Best run time in seconds, negative if a run failed
  */
-static void bf_static_optimize(char* input_buf, int input_len);
+static double time_program(const char* binary, const char* input, const char* output);
 
 /**
- * Outputs program usage to stderr.
+ * Checks whether two files have the same contents.
  *
- * @param cmd First command line argument passed to main (argv[0])
- * @return    EXIT_FAILURE
+ * @param a First file path
+ * @param b Second file path
+ * @return  Nonzero if both files could be read and are identical
  */
-static int usage(char* cmd);
+static int files_equal(const char* a, const char* b);
+
+/**
+ * Formats a short description of the backend and tuning knobs in <opts>.
+ *
+ * @param opts Code generation options
+ * @param buf  Buffer to write the description to
+ * @param size Buffer size
+ */
+static void describe_tuning(const struct codegen_options* opts, char* buf, int size);
+
+/**
+ * Generates code for a program with the selected backend and compiles it
+ * into the output binary.
+ *
+ * @param prog   Optimized program
+ * @param opts   Code generation options
+ * @param output Output binary path
+ * @return       0 on success, nonzero compiler status otherwise
+ */
+static int build_program(const struct bf_program* prog, const struct codegen_options* opts, const char* output);
+
+/**
+ * Builds a program from per-region objects. Each region is compiled on its
+ * own and its object kept in the cache, so a rebuild after an edit only
+ * compiles the regions whose code changed, then relinks.
+ *
+ * @param prog      Optimized program
+ * @param opts      Code generation options
+ * @param cache_dir Cache directory holding region objects
+ * @param output    Output binary path
+ * @return          0 on success, nonzero compiler status otherwise
+ */
+static int build_incremental(const struct bf_program* prog, const struct codegen_options* opts, const char* cache_dir, const char* output);
+
+/**
+ * Compiles generated C source into the output binary with gcc.
+ *
+ * @param opts   Code generation options
+ * @param source Generated C source path
+ * @param output Output binary path
+ * @return       0 on success, nonzero compiler status otherwise
+ */
+static int compile_c(const struct codegen_options* opts, const char* source, const char* output);
+
+/**
+ * Compiles generated LLVM IR into the output binary, with clang if it is
+ * installed and with opt, llc and gcc otherwise.
+ *
+ * @param opts   Code generation options
+ * @param source Generated IR path, ending in .ll
+ * @param output Output binary path
+ * @return       0 on success, nonzero compiler status otherwise
+ */
+static int compile_llvm(const struct codegen_options* opts, const char* source, const char* output);
+
+/**
+ * Reads the major version of an LLVM tool from its --version output.
+ *
+ * @param tool Executable name
+ * @return     Major version, 0 if it couldn't be determined
+ */
+static int llvm_version(const char* tool);
+
+/**
+ * Assembles generated assembly with as and links it with gcc.
+ *
+ * @param opts   Code generation options
+ * @param source Generated assembly path, ending in .s
+ * @param output Output binary path
+ * @return       0 on success, nonzero compiler status otherwise
+ */
+static int compile_asm(const struct codegen_options* opts, const char* source, const char* output);
+
+/**
+ * Appends the gcc code generation flags for the options to a command line.
+ *
+ * @param opts     Code generation options
+ * @param argv     Command line to append to
+ * @param argc     Current command line length
+ * @param opt_flag Buffer for the optimization level flag
+ * @param size     Buffer size
+ * @return         New command line length
+ */
+static int append_compile_flags(const struct codegen_options* opts, const char** argv, int argc, char* opt_flag, int size);
+
+/**
+ * Appends the output path and runtime library flags to a compiler command
+ * line and terminates it.
+ *
+ * @param opts         Code generation options
+ * @param output       Output binary path
+ * @param argv         Command line to append to
+ * @param argc         Current command line length
+ * @param runtime_flag Buffer for the library search path flag
+ * @param size         Buffer size
+ * @return             New command line length
+ */
+static int append_link_flags(const struct codegen_options* opts, const char* output, const char** argv, int argc, char* runtime_flag, int size);
+
+/**
+ * Returns the directory holding the runtime libraries.
+ */
+static const char* runtime_dir(void);
+
+/**
+ * Starts a command without waiting for it.
+ *
+ * @param argv NULL-terminated command line, searched for in the PATH
+ * @return     Process ID of the command, -1 if it couldn't be started
+ */
+static pid_t start_command(const char** argv);
+
+/**
+ * Runs a command and waits for it to exit.
+ *
+ * @param argv NULL-terminated command line, searched for in the PATH
+ * @return     Wait status of the command, nonzero on failure
+ */
+static int run_command(const char** argv);
+
+/**
+ * Checks whether an executable is available in the PATH.
+ *
+ * @param name Executable name
+ * @return     Nonzero if found
+ */
+static int find_executable(const char* name);
+
+/**
+ * Lists the external tools that build a program with the chosen backend,
+ * so cache keys can identify their versions.
+ *
+ * @param opts Code generation options
+ * @return     NULL-terminated list of executable names
+ */
+static const char* const* backend_tools(const struct codegen_options* opts);
 
 /**
  * Compiler entry point.
@@ -69,17 +249,158 @@ int main(int argc, char** argv) {
     /* Parse command-line options. */
     FILE* input_file = stdin;
     const char* output_file_path = "./a.out";
+    const char* cache_dir = NULL;
+    const char* tune_input = NULL;
+    const char* profile_input = NULL;
+    int backend_given = 0;
+
+    struct codegen_options opts = {
+        .tape_length  = CODEGEN_TAPE_LENGTH,
+        .heatmap_path = NULL,
+        .opt_level    = 3,
+    };
+
+    struct bf_program prog;
+    struct bf_profile profile;
+
+    static const struct option long_options[] = {
+        { "autotune", required_argument, NULL, 'A' },
+        { NULL, 0, NULL, 0 },
+    };
 
     int opt;
-    while ((opt = getopt(argc, argv, "ho:")) != -1) {
+    char* endptr;
+    while ((opt = getopt_long(argc, argv, "A:b:C:hH:iLo:p:Pr:s:t:u:w", long_options, NULL)) != -1) {
         switch (opt) {
         default:
         case 'h':
             return usage(*argv);
+        case 'A':
+            tune_input = optarg;
+            break;
+        case 'b':
+            backend_given = 1;
+
+            if (!strcmp(optarg, "c")) {
+                opts.backend = BACKEND_C;
+            } else if (!strcmp(optarg, "llvm")) {
+                opts.backend = BACKEND_LLVM;
+            } else if (!strcmp(optarg, "asm")) {
+                opts.backend = BACKEND_ASM;
+            } else if (!strcmp(optarg, "gccjit")) {
+                opts.backend = BACKEND_GCCJIT;
+            } else if (!strcmp(optarg, "bf")) {
+                opts.backend = BACKEND_BF;
+            } else {
+                fprintf(stderr, "error: unknown backend %s\n", optarg);
+                return usage(*argv);
+            }
+            break;
+        case 'C':
+            cache_dir = optarg;
+            break;
+        case 'H':
+            opts.heatmap_path = optarg;
+            break;
+        case 'i':
+            opts.incremental = 1;
+            break;
+        case 'L':
+            opts.lock = 1;
+            /* fallthrough */
+        case 'P':
+            opts.prefault = 1;
+            break;
         case 'o':
             output_file_path = optarg;
             break;
+        case 'p':
+            opts.profile_path = optarg;
+            break;
+        case 'r':
+            if (!strcmp(optarg, "libc")) {
+                opts.runtime = RUNTIME_LIBC;
+            } else if (!strcmp(optarg, "nostdlib")) {
+                opts.runtime = RUNTIME_NOSTDLIB;
+            } else if (!strcmp(optarg, "replay")) {
+                opts.runtime = RUNTIME_REPLAY;
+            } else {
+                fprintf(stderr, "error: unknown runtime %s\n", optarg);
+                return usage(*argv);
+            }
+            break;
+        case 's':
+            opts.step_limit = strtol(optarg, &endptr, 10);
+
+            if (*endptr || opts.step_limit <= 0) {
+                fprintf(stderr, "error: invalid step limit %s\n", optarg);
+                return usage(*argv);
+            }
+            break;
+        case 't':
+            opts.tape_length = (int) strtol(optarg, &endptr, 10);
+
+            if (*endptr || opts.tape_length <= 0) {
+                fprintf(stderr, "error: invalid tape length %s\n", optarg);
+                return usage(*argv);
+            }
+            break;
+        case 'u':
+            profile_input = optarg;
+            break;
+        case 'w':
+            opts.wrap = 1;
+            break;
+        }
+    }
+
+    if (opts.runtime == RUNTIME_NOSTDLIB && opts.heatmap_path) {
+        fprintf(stderr, "error: heatmap instrumentation requires the libc runtime\n");
+        return usage(*argv);
+    }
+
+    if (opts.backend != BACKEND_C && opts.heatmap_path) {
+        fprintf(stderr, "error: heatmap instrumentation requires the C backend\n");
+        return usage(*argv);
+    }
+
+    if (opts.runtime == RUNTIME_NOSTDLIB && opts.profile_path) {
+        fprintf(stderr, "error: profile instrumentation requires the libc runtime\n");
+        return usage(*argv);
+    }
+
+    if (opts.backend != BACKEND_C && (opts.profile_path || profile_input)) {
+        fprintf(stderr, "error: branch profiles require the C backend\n");
+        return usage(*argv);
+    }
+
+    if (opts.backend == BACKEND_BF && (opts.step_limit || tune_input)) {
+        fprintf(stderr, "error: brainfuck output can't be step limited or autotuned\n");
+        return usage(*argv);
+    }
+
+    if (opts.incremental && (!cache_dir || opts.backend != BACKEND_C)) {
+        fprintf(stderr, "error: incremental builds require the C backend and a cache directory\n");
+        return usage(*argv);
+    }
+
+    if (opts.incremental && (opts.heatmap_path || opts.profile_path || profile_input || tune_input)) {
+        fprintf(stderr, "error: incremental builds can't be instrumented, profiled or autotuned\n");
+        return usage(*argv);
+    }
+
+    if (tune_input && (opts.heatmap_path || opts.profile_path)) {
+        fprintf(stderr, "error: autotuning can't be combined with instrumentation\n");
+        return usage(*argv);
+    }
+
+    if (profile_input) {
+        if (bf_profile_load(profile_input, &profile)) {
+            fprintf(stderr, "error: couldn't read branch profile %s\n", profile_input);
+            return -1;
         }
+
+        opts.profile = &profile;
     }
 
     if (optind < argc) {
@@ -92,56 +413,294 @@ int main(int argc, char** argv) {
     }
 
     /* Read all input source. */
-    char c = 0;
-
-    char* input_buf = malloc(INITIAL_INPUT_BUF);
-    int input_buf_size = INITIAL_INPUT_BUF;
-    int input_len = 0;
-
-    while ((c = fgetc(input_file)) != EOF) {
-        /* Ignore invalid characters early to keep the buffer clean. */
-        switch (c) {
-        case '+':
-        case '-':
-        case '>':
-        case '<':
-        case '[':
-        case ']':
-        case '.':
-        case ',':
+    char* input_buf;
+    int input_len;
+
+    if (bf_read_source(input_file, &input_buf, &input_len)) {
+        return -1;
+    }
+
+    fprintf(stderr, "info: read %d bytes of input code\n", input_len);
+
+    /* Close input file if it's a real file. */
+    if (input_file != stdin) {
+        fclose(input_file);
+    }
+
+    /* Pick the fastest configuration for this program, or reuse the one
+     * an earlier autotuning run recorded in the cache. An explicit backend
+     * takes precedence over a recorded one, and instrumented or profiled
+     * builds need the C backend they were checked against above. */
+    char tuning_key[512];
+    int tuning_cached = cache_dir && !bf_cache_tuning_key(input_buf, input_len, &opts, tuning_key, sizeof tuning_key);
+
+    if (tune_input) {
+        if (autotune(input_buf, input_len, &opts, tune_input)) {
+            free(input_buf);
+            return -1;
+        }
+
+        if (tuning_cached) {
+            bf_cache_store_tuning(cache_dir, tuning_key, &opts);
+        } else if (!cache_dir) {
+            fprintf(stderr, "info: pass -C to record the tuned configuration for later builds\n");
+        }
+    } else if (tuning_cached && !backend_given && !opts.incremental && !opts.heatmap_path && !opts.profile_path && !opts.profile
+               && !bf_cache_fetch_tuning(cache_dir, tuning_key, &opts)) {
+        char name[64];
+
+        describe_tuning(&opts, name, sizeof name);
+        fprintf(stderr, "info: using autotuned configuration %s\n", name);
+    }
+
+    /* Perform static optimization and translate to intermediate form. */
+    if (bf_optimize_source(input_buf, input_len, &opts, &prog)) {
+        free(input_buf);
+        return -1;
+    }
+
+    free(input_buf);
+
+    /* Reuse an earlier build of the same optimized program if cached.
+     * Native builds are only cached when the host CPU is known. */
+    char cache_key[512], toolchain[128];
+    int cached = cache_dir && !bf_cache_toolchain(backend_tools(&opts), toolchain, sizeof toolchain)
+        && !bf_cache_key(&prog, &opts, runtime_dir(), toolchain, cache_key, sizeof cache_key);
+
+    if (cache_dir && !cached) {
+        fprintf(stderr, "warning: couldn't identify the toolchain or host CPU, not caching this build\n");
+    }
+
+    if (cached && !bf_cache_fetch(cache_dir, cache_key, output_file_path)) {
+        fprintf(stderr, "info: reused cached build for %s\n", output_file_path);
+        bf_free(&prog);
+        return 0;
+    }
+
+    /* Generate and compile the program. */
+    int status = opts.incremental ? build_incremental(&prog, &opts, cache_dir, output_file_path) : build_program(&prog, &opts, output_file_path);
+    bf_free(&prog);
+
+    if (profile_input) {
+        bf_profile_free(&profile);
+    }
+
+    if (cached && !status) {
+        bf_cache_store(cache_dir, cache_key, output_file_path);
+    }
+
+    return status;
+}
+
+int autotune(const char* source, int len, struct codegen_options* opts, const char* input) {
+    char binary[] = "/tmp/bfoc.XXXXXX", reference[] = "/tmp/bfoc.XXXXXX", results[] = "/tmp/bfoc.XXXXXX";
+    char name[64];
+    int fds[] = { mkstemp(binary), mkstemp(reference), mkstemp(results) };
+    int best = -1, status = 0;
+    double best_time = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        if (fds[i] < 0) {
+            fprintf(stderr, "error: Couldn't create temporary file: %s\n", strerror(errno));
+            status = -1;
+        } else {
+            close(fds[i]);
+        }
+    }
+
+    for (int i = 0; !status && i < (int) (sizeof tune_configs / sizeof *tune_configs); ++i) {
+        struct codegen_options trial = *opts;
+        struct bf_program prog;
+
+        trial.backend = tune_configs[i].backend;
+        trial.opt_level = tune_configs[i].opt_level;
+        trial.native = tune_configs[i].native;
+        trial.no_cell_cache = tune_configs[i].no_cell_cache;
+        trial.no_vectorize = tune_configs[i].no_vectorize;
+
+        describe_tuning(&trial, name, sizeof name);
+
+        if (bf_optimize_source(source, len, &trial, &prog)) {
+            status = -1;
             break;
-        default:
+        }
+
+        int build_status = build_program(&prog, &trial, binary);
+        bf_free(&prog);
+
+        if (build_status) {
+            fprintf(stderr, "warning: autotune: %s failed to build, skipping\n", name);
             continue;
         }
 
-        input_buf[input_len++] = c;
+        /* The first configuration to run sets the expected output. */
+        double elapsed = time_program(binary, input, best < 0 ? reference : results);
 
-        if (input_len >= input_buf_size) {
-            input_buf_size *= 2;
-            input_buf = realloc(input_buf, input_buf_size);
+        if (elapsed < 0) {
+            fprintf(stderr, "warning: autotune: %s failed to run, skipping\n", name);
+            continue;
+        }
+
+        if (best >= 0 && !files_equal(reference, results)) {
+            fprintf(stderr, "warning: autotune: %s produced different output, skipping\n", name);
+            continue;
+        }
+
+        fprintf(stderr, "info: autotune: %s ran in %.3f ms\n", name, elapsed * 1000.0);
+
+        if (best < 0 || elapsed < best_time) {
+            best = i;
+            best_time = elapsed;
         }
     }
 
-    input_buf[input_len] = '\0';
-    fprintf(stderr, "info: read %d bytes of input code\n", input_len);
+    unlink(binary);
+    unlink(reference);
+    unlink(results);
 
-    /* Close input file if it's a real file. */
-    if (input_file != stdin) {
-        fclose(input_file);
+    if (status || best < 0) {
+        fprintf(stderr, "error: autotune: no configuration could be timed\n");
+        return -1;
     }
 
-    /* Create the C source output file and open it */
-    char c_output_filename[] = "/tmp/bfoc.XXXXXX.c";
-    int c_output_file_fd = mkstemps(c_output_filename, 2);
+    opts->backend = tune_configs[best].backend;
+    opts->opt_level = tune_configs[best].opt_level;
+    opts->native = tune_configs[best].native;
+    opts->no_cell_cache = tune_configs[best].no_cell_cache;
+    opts->no_vectorize = tune_configs[best].no_vectorize;
+
+    describe_tuning(opts, name, sizeof name);
+    fprintf(stderr, "info: autotune: selected %s (%.3f ms)\n", name, best_time * 1000.0);
+
+    return 0;
+}
+
+double time_program(const char* binary, const char* input, const char* output) {
+    double best = -1;
+
+    for (int run = 0; run < TUNE_RUNS; ++run) {
+        struct timespec start, end;
+        int child_status;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t child = fork();
+
+        if (child < 0) {
+            fprintf(stderr, "error: couldn't start %s: %s\n", binary, strerror(errno));
+            return -1;
+        }
+
+        if (!child) {
+            int in = open(input, O_RDONLY);
+            int out = open(output, O_WRONLY | O_TRUNC);
+
+            if (in < 0 || out < 0 || dup2(in, STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0) {
+                fprintf(stderr, "error: child process: couldn't redirect %s: %s\n", binary, strerror(errno));
+                _exit(EXIT_FAILURE);
+            }
+
+            execl(binary, binary, (char*) NULL);
+            fprintf(stderr, "error: child process: couldn't execute %s: %s\n", binary, strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+
+        waitpid(child, &child_status, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (child_status) {
+            return -1;
+        }
+
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
 
-    if (c_output_file_fd < 0) {
+    return best;
+}
+
+int files_equal(const char* a, const char* b) {
+    FILE* fa = fopen(a, "rb");
+    FILE* fb = fopen(b, "rb");
+    int equal = fa && fb, ca, cb;
+
+    while (equal) {
+        ca = fgetc(fa);
+        cb = fgetc(fb);
+        equal = ca == cb;
+
+        if (ca == EOF) {
+            break;
+        }
+    }
+
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+
+    return equal;
+}
+
+void describe_tuning(const struct codegen_options* opts, char* buf, int size) {
+    static const char* backends[] = { "c", "llvm", "asm", "gccjit", "bf" };
+
+    snprintf(buf, size, "%s -O%d%s%s%s", backends[opts->backend], opts->opt_level,
+             opts->native ? " native" : "",
+             opts->no_cell_cache ? " no-cell-cache" : "",
+             opts->no_vectorize ? " no-vectorize" : "");
+}
+
+int build_program(const struct bf_program* prog, const struct codegen_options* opts, const char* output) {
+    /* libgccjit builds the binary straight from the IR, in-process. */
+    if (opts->backend == BACKEND_GCCJIT) {
+        int status = generate_gccjit_binary(prog, opts, runtime_dir(), output);
+
+        if (status) {
+            fprintf(stderr, "error: libgccjit compile failed. stopping..\n");
+        } else {
+            fprintf(stderr, "info: successfully compiled output %s\n", output);
+        }
+
+        return status;
+    }
+
+    /* Brainfuck output is the final product, there is nothing to compile. */
+    if (opts->backend == BACKEND_BF) {
+        FILE* out = fopen(output, "w");
+
+        if (!out) {
+            fprintf(stderr, "error: couldn't open %s for writing: %s\n", output, strerror(errno));
+            return -1;
+        }
+
+        int status = generate_bf_source(prog, opts, out);
+
+        if (fclose(out) || status) {
+            fprintf(stderr, "error: code generation failed. stopping..\n");
+            unlink(output);
+            return -1;
+        }
+
+        fprintf(stderr, "info: wrote brainfuck output %s\n", output);
+        return 0;
+    }
+
+    /* Create the intermediate source output file and open it */
+    const char* suffix = opts->backend == BACKEND_LLVM ? ".ll" : opts->backend == BACKEND_ASM ? ".s" : ".c";
+    char source_filename[32];
+
+    snprintf(source_filename, sizeof source_filename, "/tmp/bfoc.XXXXXX%s", suffix);
+    int source_file_fd = mkstemps(source_filename, strlen(suffix));
+
+    if (source_file_fd < 0) {
         fprintf(stderr, "error: Couldn't create temporary source file: %s", strerror(errno));
         return -1;
     }
 
-    FILE* c_output_file = fdopen(c_output_file_fd, "w");
+    FILE* source_file = fdopen(source_file_fd, "w");
 
-    if (!c_output_file) {
+    if (!source_file) {
         fprintf(stderr, "error: Couldn't open temporary source file: %s", strerror(errno));
         return -1;
     }
@@ -150,166 +709,504 @@ int main(int argc, char** argv) {
     time_t cur_time;
     time(&cur_time);
 
-    fprintf(c_output_file, "/*\n * BFOC intermediate code\n * generated on %s */\n\n", ctime(&cur_time));
-    fprintf(c_output_file, "#include <stdlib.h>\n#include <stdio.h>\n#include <stdint.h>\n\n");
-    fprintf(c_output_file, "static uint8_t tape[%d], *ptr = tape;\n\n", CODEGEN_TAPE_LENGTH);
-    fprintf(c_output_file, "int main() {\n");
+    int gen_status;
 
-    /* Perform static optimization. */
-    bf_static_optimize(input_buf, input_len);
+    if (opts->backend == BACKEND_LLVM) {
+        fprintf(source_file, "; BFOC intermediate code\n; generated on %s\n", ctime(&cur_time));
+        gen_status = generate_llvm_source(prog, opts, source_file);
+    } else if (opts->backend == BACKEND_ASM) {
+        fprintf(source_file, "# BFOC intermediate code\n# generated on %s\n", ctime(&cur_time));
+        gen_status = generate_asm_source(prog, opts, source_file);
+    } else {
+        fprintf(source_file, "/*\n * BFOC intermediate code\n * generated on %s */\n\n", ctime(&cur_time));
+        generate_c_prologue(prog, opts, source_file);
+        gen_status = generate_c_source(prog, opts, source_file);
+        generate_c_epilogue(opts, source_file);
+    }
 
     /* Write generated code to output. */
-    if (generate_c_source(input_buf, input_len, c_output_file)) {
+    if (gen_status) {
         fprintf(stderr, "error: code generation failed. stopping..\n");
-        fclose(c_output_file);
+        fclose(source_file);
         return -1;
     }
 
-    /* Write terminator boilerplate and close the output. */
-    fprintf(c_output_file, "\treturn 0;\n}\n\n");
-    fclose(c_output_file);
+    fclose(source_file);
 
-    fprintf(stderr, "info: wrote intermediate C source to %s\n", c_output_filename);
+    fprintf(stderr, "info: wrote intermediate source to %s\n", source_filename);
 
-    /* Run gcc and generate the final output. */
-    if (!fork()) {
-        int exec_status = execlp(GCC_EXECUTABLE, GCC_EXECUTABLE, "-O3", c_output_filename, "-o", output_file_path, NULL);
+    /* Compile the intermediate source and generate the final output. */
+    int status;
 
-        if (exec_status) {
-            fprintf(stderr, "error: child process: couldn't execute compiler: %s\n", strerror(errno));
-        }
+    if (opts->backend == BACKEND_LLVM) {
+        status = compile_llvm(opts, source_filename, output);
+    } else if (opts->backend == BACKEND_ASM) {
+        status = compile_asm(opts, source_filename, output);
+    } else {
+        status = compile_c(opts, source_filename, output);
+    }
 
-        return exec_status;
+    fprintf(stderr, "info: cleaning up intermediate source %s\n", source_filename);
+    unlink(source_filename);
+
+    if (status) {
+        fprintf(stderr, "error: child process reported compile failed (code %d).\n", status);
     } else {
+        fprintf(stderr, "info: successfully compiled output %s\n", output);
+    }
+
+    return status;
+}
+
+int build_incremental(const struct bf_program* prog, const struct codegen_options* opts, const char* cache_dir, const char* output) {
+    struct codegen_options region_opts = *opts;
+    char dir[] = "/tmp/bfoc.XXXXXX", path[64], opt_flag[8], runtime_flag[4096], toolchain[128];
+    int* starts;
+    int count = bf_split_regions(prog, &starts);
+    int jobs = 0, max_jobs = sysconf(_SC_NPROCESSORS_ONLN), reused = 0, compiled = 0, status = 0;
+    int uncached = bf_cache_toolchain(backend_tools(opts), toolchain, sizeof toolchain);
+
+    /* Static cell positions would tie each region's code to everything
+     * before it, so regions address the tape through the pointer. */
+    region_opts.extent_known = 0;
+
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "error: Couldn't create temporary directory: %s\n", strerror(errno));
+        free(starts);
+        return -1;
+    }
+
+    char (*names)[64] = malloc(sizeof *names * count);
+    char (*keys)[512] = malloc(sizeof *keys * count);
+    char (*objects)[64] = malloc(sizeof *objects * count);
+    const char** calls = malloc(sizeof(const char*) * count);
+    const char** link_argv = malloc(sizeof(const char*) * (count + 24));
+    pid_t* pids = malloc(sizeof(pid_t) * count);
+    int* unique = malloc(sizeof(int) * count);
+    int link_argc = 0, nunique = 0;
+
+    if (max_jobs < 1) {
+        max_jobs = 1;
+    }
+
+    link_argv[link_argc++] = GCC_EXECUTABLE;
+    link_argc = append_compile_flags(&region_opts, link_argv, link_argc, opt_flag, sizeof opt_flag);
+
+    snprintf(path, sizeof path, "%s/main.c", dir);
+    link_argv[link_argc++] = path;
+
+    for (int r = 0; r < count && !status; ++r) {
+        struct bf_program region = { 0 };
+        int end = r + 1 < count ? starts[r + 1] : prog->len, seen = 0;
+
+        for (int i = starts[r]; i < end; ++i) {
+            bf_append_copy(&region, prog, &prog->ops[i], 0);
+        }
+
+        bf_rematch(&region);
+        uncached |= bf_cache_region_key(&region, &region_opts, toolchain, names[r], sizeof names[r], keys[r], sizeof keys[r]);
+        calls[r] = names[r];
+
+        /* Identical regions share a function. */
+        for (int u = 0; u < nunique && !seen; ++u) {
+            seen = !strcmp(names[unique[u]], names[r]);
+        }
+
+        snprintf(objects[r], sizeof objects[r], "%s/%s.o", dir, names[r]);
+        pids[r] = 0;
+
+        if (seen) {
+            bf_free(&region);
+            continue;
+        }
+
+        unique[nunique++] = r;
+        link_argv[link_argc++] = objects[r];
+
+        if (!uncached && !bf_cache_fetch(cache_dir, keys[r], objects[r])) {
+            ++reused;
+            bf_free(&region);
+            continue;
+        }
+
+        char source[64];
+        snprintf(source, sizeof source, "%s/%s.c", dir, names[r]);
+
+        FILE* out = fopen(source, "w");
+
+        if (!out || generate_c_region(&region, &region_opts, names[r], out)) {
+            fprintf(stderr, "error: code generation failed. stopping..\n");
+            status = -1;
+        }
+
+        if (out) fclose(out);
+        bf_free(&region);
+
+        /* Compile the changed regions in parallel, storing each object as
+         * its compile finishes. */
+        while (!status && jobs == max_jobs) {
+            int child_status;
+            pid_t child = wait(&child_status);
+
+            for (int u = 0; u < nunique; ++u) {
+                if (pids[unique[u]] == child) {
+                    pids[unique[u]] = 0;
+                    status = child_status;
+                    if (!status && !uncached) bf_cache_store(cache_dir, keys[unique[u]], objects[unique[u]]);
+                }
+            }
+
+            --jobs;
+        }
+
+        if (!status) {
+            const char* gcc_argv[24];
+            int gcc_argc = 0;
+
+            gcc_argv[gcc_argc++] = GCC_EXECUTABLE;
+            gcc_argc = append_compile_flags(&region_opts, gcc_argv, gcc_argc, opt_flag, sizeof opt_flag);
+            gcc_argv[gcc_argc++] = "-c";
+            gcc_argv[gcc_argc++] = source;
+            gcc_argv[gcc_argc++] = "-o";
+            gcc_argv[gcc_argc++] = objects[r];
+            gcc_argv[gcc_argc] = NULL;
+
+            if ((pids[r] = start_command(gcc_argv)) < 0) {
+                pids[r] = 0;
+                status = -1;
+            } else {
+                ++jobs;
+                ++compiled;
+            }
+        }
+    }
+
+    while (jobs) {
         int child_status;
-        wait(&child_status);
+        pid_t child = wait(&child_status);
 
-        fprintf(stderr, "info: cleaning up intermediate source %s\n", c_output_filename);
-        unlink(c_output_filename);
+        for (int u = 0; u < nunique; ++u) {
+            if (pids[unique[u]] == child) {
+                pids[unique[u]] = 0;
+                if (!status) status = child_status;
+                if (!child_status && !uncached) bf_cache_store(cache_dir, keys[unique[u]], objects[unique[u]]);
+            }
+        }
 
-        if (child_status) {
-            fprintf(stderr, "error: child process reported compile failed (code %d).\n", child_status);
+        --jobs;
+    }
+
+    fprintf(stderr, "info: built %d regions, %d reused from the cache and %d compiled\n", count, reused, compiled);
+
+    /* The main translation unit calls the regions in order and is always
+     * compiled, it is small. */
+    if (!status) {
+        FILE* out = fopen(path, "w");
+
+        if (!out) {
+            fprintf(stderr, "error: Couldn't open temporary source file: %s\n", strerror(errno));
+            status = -1;
         } else {
-            fprintf(stderr, "info: successfully compiled output %s\n", output_file_path);
+            generate_c_region_main(&region_opts, calls, count, out);
+            fclose(out);
+
+            append_link_flags(&region_opts, output, link_argv, link_argc, runtime_flag, sizeof runtime_flag);
+            status = run_command(link_argv);
         }
+    }
 
-        return child_status;
+    if (status) {
+        fprintf(stderr, "error: child process reported compile failed (code %d).\n", status);
+    } else {
+        fprintf(stderr, "info: successfully compiled output %s\n", output);
     }
 
-    return 0;
+    /* Clean up the intermediate sources and objects. */
+    for (int u = 0; u < nunique; ++u) {
+        char source[64];
+
+        snprintf(source, sizeof source, "%s/%s.c", dir, names[unique[u]]);
+        unlink(source);
+        unlink(objects[unique[u]]);
+    }
+
+    unlink(path);
+    rmdir(dir);
+
+    free(starts);
+    free(names);
+    free(keys);
+    free(objects);
+    free(calls);
+    free(link_argv);
+    free(pids);
+    free(unique);
+
+    return status;
 }
 
-int generate_c_source(char* input_buf, int input_len, FILE* output_file) {
-    int instr_count;
-    int label_stack = 0;
-    int label_placed = 0;
-
-    /* Don't increment i in the loop condition, as most of the cases
-     * will increment it during scanning logic anyway. */
-    for (int i = 0; i < input_len;) {
-        switch (input_buf[i]) {
-        case '+':
-            /* Walk through any consecutive '+' operators and bundle them into
-             * one instruction. */
-            instr_count = 1;
-            while (input_buf[++i] == '+') ++instr_count;
-            fprintf(output_file, "\t*ptr += %d;\n", instr_count);
-            break;
-        case '-':
-            /* Walk through any consecutive '-' operators and bundle them into
-             * one instruction. */
-            instr_count = 1;
-            while (input_buf[++i] == '-') ++instr_count;
-            fprintf(output_file, "\t*ptr -= %d;\n", instr_count);
-            break;
-        case '>':
-            /* Walk through any consecutive '>' operators and bundle them into
-             * one instruction. */
-            instr_count = 1;
-            while (input_buf[++i] == '>') ++instr_count;
-            fprintf(output_file, "\tptr += %d;\n", instr_count);
-            break;
-        case '<':
-            /* Walk through any consecutive '<' operators and bundle them into
-             * one instruction. */
-            instr_count = 1;
-            while (input_buf[++i] == '<') ++instr_count;
-            fprintf(output_file, "\tptr -= %d;\n", instr_count);
-            break;
-        case '.':
-            /* Output tape value */
-            fprintf(output_file, "\tputchar(*ptr);\n");
-            ++i;
-            break;
-        case ',':
-            /* Input tape value */
-            fprintf(output_file, "\t*ptr = getchar();\n");
-            ++i;
-            break;
-        case '[':
-            /* New loop point. */
-            fprintf(output_file, "loop%d:\n\tif (*ptr) {\n", i++);
-            break;
-        case ']':
-            /* Walk back through the source code to find the matching label location. */
-            label_placed = 0;
-            for (int j = i; j >= 0; --j) {
-                if (input_buf[j] == ']') label_stack++;
-                if (input_buf[j] == '[') {
-                    if (--label_stack <= 0) {
-                        /* Found the matching label location. */
-                        fprintf(output_file, "\tgoto loop%d; }\n", j);
-                        label_placed = 1;
-                        break;
-                    }
-                }
-            }
+int compile_c(const struct codegen_options* opts, const char* source, const char* output) {
+    const char* gcc_argv[24];
+    char runtime_flag[4096], opt_flag[8];
+    int gcc_argc = 0;
 
-            if (!label_placed) {
-                fprintf(stderr, "error: failed to match loop end at location %d\n", i);
-                return -1;
-            }
+    gcc_argv[gcc_argc++] = GCC_EXECUTABLE;
+    gcc_argc = append_compile_flags(opts, gcc_argv, gcc_argc, opt_flag, sizeof opt_flag);
+    gcc_argv[gcc_argc++] = source;
+    gcc_argc = append_link_flags(opts, output, gcc_argv, gcc_argc, runtime_flag, sizeof runtime_flag);
 
-            ++i;
-            break;
-        case 'z':
-            /* Cell zero instruction */
-            fprintf(output_file, "\t*ptr = 0;\n");
-            ++i;
-            break;
-        default:
-            /* Any no-ops will fall here (from static optimization) */
-            ++i;
+    return run_command(gcc_argv);
+}
+
+int compile_llvm(const struct codegen_options* opts, const char* source, const char* output) {
+    const char* cmd_argv[24];
+    char runtime_flag[4096], opt_flag[8], bitcode[32], object[32];
+    int cmd_argc = 0, status;
+
+    snprintf(opt_flag, sizeof opt_flag, "-O%d", opts->opt_level);
+
+    /* clang takes IR directly and drives the link itself. */
+    if (find_executable(CLANG_EXECUTABLE)) {
+        cmd_argv[cmd_argc++] = CLANG_EXECUTABLE;
+        cmd_argv[cmd_argc++] = opt_flag;
+
+        if (opts->native) {
+            cmd_argv[cmd_argc++] = "-march=native";
         }
+
+        /* LLVM 14 reads opaque pointers only when asked to. */
+        if (llvm_version(CLANG_EXECUTABLE) == 14) {
+            cmd_argv[cmd_argc++] = "-mllvm";
+            cmd_argv[cmd_argc++] = "-opaque-pointers";
+        }
+
+        cmd_argv[cmd_argc++] = source;
+        cmd_argc = append_link_flags(opts, output, cmd_argv, cmd_argc, runtime_flag, sizeof runtime_flag);
+
+        return run_command(cmd_argv);
     }
 
-    return 0;
+    /* Otherwise optimize with opt, generate an object with llc and link
+     * that with gcc. The intermediates share the source's unique name. */
+    int stem = strlen(source) - strlen(".ll");
+
+    snprintf(bitcode, sizeof bitcode, "%.*s.bc", stem, source);
+    snprintf(object, sizeof object, "%.*s.o", stem, source);
+
+    const char* opt_argv[8] = { OPT_EXECUTABLE, opt_flag, source, "-o", bitcode };
+    const char* llc_argv[10] = { LLC_EXECUTABLE, opt_flag, "-relocation-model=pic", "-filetype=obj", bitcode, "-o", object };
+    int opt_argc = 5, llc_argc = 7;
+
+    if (opts->native) {
+        opt_argv[opt_argc++] = llc_argv[llc_argc++] = "-mcpu=native";
+    }
+
+    if (llvm_version(OPT_EXECUTABLE) == 14) {
+        opt_argv[opt_argc++] = "-opaque-pointers";
+    }
+
+    if (llvm_version(LLC_EXECUTABLE) == 14) {
+        llc_argv[llc_argc++] = "-opaque-pointers";
+    }
+
+    if (!(status = run_command(opt_argv)) && !(status = run_command(llc_argv))) {
+        cmd_argv[cmd_argc++] = GCC_EXECUTABLE;
+        cmd_argv[cmd_argc++] = object;
+        cmd_argc = append_link_flags(opts, output, cmd_argv, cmd_argc, runtime_flag, sizeof runtime_flag);
+
+        status = run_command(cmd_argv);
+    }
+
+    unlink(bitcode);
+    unlink(object);
+
+    return status;
 }
 
-void bf_static_optimize(char* input_buf, int input_len) {
-        /*
-         * 1: Fast cell zeroing
-         * A common patten in BF programs is "[-]" which sets the current cell
-         * value to 0 via a loop. This can be reduced to one instruction to
-         * improve performance.
-         */
+int llvm_version(const char* tool) {
+    char command[256], line[256];
+    int version = 0;
 
-        char* cell_zero_loc;
-        int cell_zero_count = 0;
+    snprintf(command, sizeof command, "%s --version 2>/dev/null", tool);
 
-        while ((cell_zero_loc = strstr(input_buf, "[-]"))) {
-                cell_zero_loc[0] = 'z'; /* cell zero instruction */
-                cell_zero_loc[1] = ' '; /* replace the others with no-ops */
-                cell_zero_loc[2] = ' ';
-                cell_zero_count++;
+    FILE* out = popen(command, "r");
+
+    if (!out) {
+        return 0;
+    }
+
+    /* "LLVM version 14.0.6", "clang version 17.0.0" and vendor variants. */
+    while (fgets(line, sizeof line, out)) {
+        char* found = strstr(line, "version ");
+
+        if (found && !version) {
+            version = atoi(found + strlen("version "));
         }
+    }
+
+    pclose(out);
+    return version;
+}
+
+int compile_asm(const struct codegen_options* opts, const char* source, const char* output) {
+    const char* link_argv[24];
+    char runtime_flag[4096], object[32];
+    int link_argc = 0, status;
+
+    snprintf(object, sizeof object, "%.*s.o", (int) (strlen(source) - strlen(".s")), source);
 
-        if (cell_zero_count) {
-                fprintf(stderr, "info: performed %d cell-zero optimizations\n", cell_zero_count);
+    const char* as_argv[] = { AS_EXECUTABLE, source, "-o", object, NULL };
+
+    if (!(status = run_command(as_argv))) {
+        link_argv[link_argc++] = GCC_EXECUTABLE;
+        link_argv[link_argc++] = object;
+        link_argc = append_link_flags(opts, output, link_argv, link_argc, runtime_flag, sizeof runtime_flag);
+
+        status = run_command(link_argv);
+    }
+
+    unlink(object);
+
+    return status;
+}
+
+int append_compile_flags(const struct codegen_options* opts, const char** argv, int argc, char* opt_flag, int size) {
+    snprintf(opt_flag, size, "-O%d", opts->opt_level);
+    argv[argc++] = opt_flag;
+
+    if (opts->native) {
+        argv[argc++] = "-march=native";
+    }
+
+    if (opts->runtime == RUNTIME_NOSTDLIB) {
+        argv[argc++] = "-ffreestanding";
+        argv[argc++] = "-fno-stack-protector";
+    }
+
+    return argc;
+}
+
+int append_link_flags(const struct codegen_options* opts, const char* output, const char** argv, int argc, char* runtime_flag, int size) {
+    snprintf(runtime_flag, size, "-L%s", runtime_dir());
+
+    if (opts->runtime == RUNTIME_NOSTDLIB) {
+        argv[argc++] = "-static";
+        argv[argc++] = "-nostdlib";
+    }
+
+    argv[argc++] = "-o";
+    argv[argc++] = output;
+    argv[argc++] = runtime_flag;
+
+    /* The replay layer's putchar() and getchar() go ahead of libc's. */
+    if (opts->runtime == RUNTIME_NOSTDLIB) {
+        argv[argc++] = "-lbfocrt-nostdlib";
+        argv[argc++] = "-lgcc";
+    } else if (opts->runtime == RUNTIME_REPLAY) {
+        argv[argc++] = "-lbfocrt-replay";
+        argv[argc++] = "-lbfocrt";
+    } else {
+        argv[argc++] = "-lbfocrt";
+    }
+
+    argv[argc] = NULL;
+    return argc;
+}
+
+const char* runtime_dir(void) {
+    const char* dir = getenv("BFOC_RUNTIME_DIR");
+    return dir ? dir : BFOC_RUNTIME_DIR;
+}
+
+pid_t start_command(const char** argv) {
+    pid_t child = fork();
+
+    if (child < 0) {
+        fprintf(stderr, "error: couldn't start %s: %s\n", argv[0], strerror(errno));
+        return -1;
+    }
+
+    if (!child) {
+        execvp(argv[0], (char* const*) argv);
+        fprintf(stderr, "error: child process: couldn't execute %s: %s\n", argv[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    return child;
+}
+
+int run_command(const char** argv) {
+    pid_t child = start_command(argv);
+
+    if (child < 0) {
+        return -1;
+    }
+
+    int child_status;
+    waitpid(child, &child_status, 0);
+
+    return child_status;
+}
+
+int find_executable(const char* name) {
+    const char* path = getenv("PATH");
+    char candidate[4096];
+
+    while (path && *path) {
+        int len = strcspn(path, ":");
+
+        snprintf(candidate, sizeof candidate, "%.*s/%s", len, len ? path : ".", name);
+
+        if (!access(candidate, X_OK)) {
+            return 1;
         }
+
+        path += len + (path[len] == ':');
+    }
+
+    return 0;
 }
 
 int usage(char* cmd) {
-    fprintf(stderr, "usage: %s [-h] [-o <output>] <input>\n", cmd);
+    fprintf(stderr, "usage: %s [-hiLPw] [-A <input>] [-b <backend>] [-C <cache>] [-o <output>] [-r <runtime>] [-s <steps>] [-t <cells>] [-H <heatmap>] [-p <profile>] [-u <profile>] <input>\n", cmd);
+    fprintf(stderr, "  -o <output>  output binary path (default ./a.out)\n");
+    fprintf(stderr, "  -t <cells>   tape length in cells (default %d)\n", CODEGEN_TAPE_LENGTH);
+    fprintf(stderr, "  -w           circular tape, rounded up to a power of two\n");
+    fprintf(stderr, "  -H <heatmap> instrument tape accesses and write a heatmap to <heatmap> at exit\n");
+    fprintf(stderr, "  -p <profile> instrument branches and write a branch profile to <profile> at exit\n");
+    fprintf(stderr, "  -u <profile> lay out hot and cold code using a branch profile from -p\n");
+    fprintf(stderr, "  -P           prefault the tape and output buffer at startup\n");
+    fprintf(stderr, "  -L           prefault and lock the tape and output buffer into memory\n");
+    fprintf(stderr, "  -r <runtime> libc (default), nostdlib for a static binary using raw syscalls,\n");
+    fprintf(stderr, "               or replay for I/O record (BFRT_RECORD=<log>) and replay (BFRT_REPLAY=<log>)\n");
+    fprintf(stderr, "  -s <steps>   stop the program with status 124 once its loops run <steps> operations\n");
+    fprintf(stderr, "  -C <cache>   reuse and store compiled binaries in the cache directory <cache>\n");
+    fprintf(stderr, "  -i           incremental build with -C: compile regions of the program separately\n");
+    fprintf(stderr, "               and reuse the cached objects of unchanged regions\n");
+    fprintf(stderr, "  -b <backend> code generator: c (default), llvm, asm (x86-64 only), gccjit,\n");
+    fprintf(stderr, "               or bf to write optimized brainfuck source instead of a binary\n");
+    fprintf(stderr, "  -A <input>, --autotune <input>\n");
+    fprintf(stderr, "               time the program on <input> under several backends and compiler\n");
+    fprintf(stderr, "               flags and build the fastest, recording it in the cache with -C\n");
     return EXIT_FAILURE;
 }
+
+const char* const* backend_tools(const struct codegen_options* opts) {
+    static const char* const gcc_tools[] = { GCC_EXECUTABLE, NULL };
+    static const char* const clang_tools[] = { CLANG_EXECUTABLE, NULL };
+    static const char* const llc_tools[] = { OPT_EXECUTABLE, LLC_EXECUTABLE, GCC_EXECUTABLE, NULL };
+    static const char* const as_tools[] = { AS_EXECUTABLE, GCC_EXECUTABLE, NULL };
+    static const char* const no_tools[] = { NULL };
+
+    switch (opts->backend) {
+    case BACKEND_LLVM:
+        return find_executable(CLANG_EXECUTABLE) ? clang_tools : llc_tools;
+    case BACKEND_ASM:
+        return as_tools;
+    case BACKEND_BF:
+        return no_tools;
+    default:
+        /* libgccjit ships with the gcc it matches. */
+        return gcc_tools;
+    }
+}
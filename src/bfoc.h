@@ -0,0 +1,578 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Shared declarations for the compiler modules: the intermediate
+ * representation, the optimizer passes and the code generators.
+ */
+
+#ifndef BFOC_H
+#define BFOC_H
+
+#include <stdio.h>
+
+#define CODEGEN_TAPE_LENGTH          30000 /* https://en.wikipedia.org/wiki/Brainfuck#Language_design */
+#define CODEGEN_REGISTER_TAPE_LENGTH 64    /* Largest static tape kept local to main() */
+#define CODEGEN_CACHED_CELLS         8     /* Cells of a loop nest held in locals */
+#define BF_VEC_MAX_LANES             16    /* Widest vector cell update */
+#define BF_VEC_MIN_SPAN              4     /* Narrowest run of cells worth vectorizing */
+#define BF_EVAL_STEP_LIMIT           (1L << 22) /* Operations evaluated at compile time */
+#define BF_EVAL_OUTPUT_LIMIT         (1 << 16)  /* Output bytes produced at compile time */
+#define BF_PROFILE_COLD_RATIO        10000 /* Branch sites this much rarer than the hottest are cold */
+#define BF_REGION_SPREAD             16    /* Average top-level loops per incremental build region */
+
+/**
+ * Intermediate representation operation types. Cell operands are addressed
+ * relative to the tape pointer by the operation offset.
+ */
+enum bf_op_type {
+    BF_OP_ADD,    /* cell[offset] += arg */
+    BF_OP_SET,    /* cell[offset] = arg */
+    BF_OP_MOVE,   /* ptr += arg */
+    BF_OP_OUTPUT, /* putchar(cell[offset]) */
+    BF_OP_INPUT,  /* cell[offset] = getchar() */
+    BF_OP_LOOP,   /* while (cell[0]) { */
+    BF_OP_END,    /* } */
+    BF_OP_VEC,    /* cell[offset + i] = (cell[offset + i] & mask[i]) + add[i] for i < arg */
+    BF_OP_MUL,    /* cell[offset] += cell[src] * arg */
+    BF_OP_IF,     /* if (cell[0]) { */
+    BF_OP_ENDIF,  /* } */
+};
+
+/**
+ * A single intermediate representation operation.
+ */
+struct bf_op {
+    enum bf_op_type type;
+    int offset; /* Cell offset relative to the tape pointer */
+    int arg;    /* Operation argument (cell delta, value or pointer delta) */
+    int match;  /* Index of the matching loop or if delimiter, or of the BF_OP_VEC lanes */
+    int src;    /* Source cell offset for BF_OP_MUL */
+};
+
+/**
+ * Lane data for a vector cell update. A lane with mask 0xff adds to the
+ * cell, a lane with mask 0 sets it.
+ */
+struct bf_vec {
+    unsigned char mask[BF_VEC_MAX_LANES];
+    unsigned char add[BF_VEC_MAX_LANES];
+};
+
+/**
+ * A brainfuck program in intermediate form.
+ */
+struct bf_program {
+    struct bf_op* ops;
+    int len;
+    int cap;
+
+    struct bf_vec* vecs;
+    int vecs_len;
+    int vecs_cap;
+};
+
+/**
+ * Execution counts of a branch site, a BF_OP_LOOP or BF_OP_IF, from a
+ * profiling run. Loop conditions are tested on entry and on every
+ * iteration.
+ */
+struct bf_profile_site {
+    unsigned long long tests; /* Times the condition was evaluated */
+    unsigned long long taken; /* Times the condition was nonzero */
+};
+
+/**
+ * A branch profile, with one site per BF_OP_LOOP and BF_OP_IF in program
+ * order.
+ */
+struct bf_profile {
+    struct bf_profile_site* sites;
+    int len;
+    unsigned long long peak; /* Largest test count of any site */
+};
+
+/**
+ * Runtime environments the generated program can be built against.
+ */
+enum codegen_runtime {
+    RUNTIME_LIBC,     /* Hosted program using stdio */
+    RUNTIME_NOSTDLIB, /* Static program with its own _start and raw syscalls */
+    RUNTIME_REPLAY,   /* Hosted program with I/O record and replay */
+};
+
+/**
+ * Code generators the program can be compiled through.
+ */
+enum codegen_backend {
+    BACKEND_C,      /* C source compiled by gcc */
+    BACKEND_LLVM,   /* LLVM IR compiled by clang, or by opt and llc */
+    BACKEND_ASM,    /* x86-64 assembly assembled by as */
+    BACKEND_GCCJIT, /* In-process compilation through libgccjit */
+    BACKEND_BF,     /* Optimized brainfuck source, not compiled */
+};
+
+/**
+ * Code generation options, set from the command line.
+ */
+struct codegen_options {
+    int tape_length;          /* Number of cells in the generated tape */
+    const char* heatmap_path; /* Tape heatmap output path, NULL if not instrumented */
+    const char* profile_path; /* Branch profile output path, NULL if not instrumented */
+    const struct bf_profile* profile; /* Branch profile to lay out code by, NULL if none */
+    int wrap;                 /* Circular tape, tape_length is a power of two */
+    int prefault;             /* Fault in the tape and output buffer at startup */
+    int lock;                 /* Lock the tape and output buffer into memory */
+    enum codegen_runtime runtime;
+    enum codegen_backend backend;
+    long step_limit;          /* Operations the program may run in loops, 0 for no limit */
+    int incremental;          /* Build from separately cached objects per region */
+
+    /* Tuning knobs, searched by the autotuner */
+    int opt_level;            /* Backend compiler optimization level */
+    int native;               /* Compile for the host CPU (-march=native) */
+    int no_cell_cache;        /* Keep the cells of loop nests in memory */
+    int no_vectorize;         /* Skip the vectorization pass */
+
+    /* Static tape extent, filled in by bf_tape_extent() */
+    int extent_known;         /* Every cell access has a statically known position */
+    int extent_min;           /* Lowest accessed cell relative to the starting cell */
+    int extent_max;           /* Highest accessed cell relative to the starting cell */
+};
+
+/**
+ * Reads brainfuck source from a stream, keeping only the commands.
+ *
+ * @param in     Stream to read
+ * @param source Set to the NUL-terminated source, to be freed by the caller
+ * @param len    Set to the source length
+ *
+ * @return 0 on success, -1 if memory ran out
+ */
+int bf_read_source(FILE* in, char** source, int* len);
+
+/**
+ * Runs the optimization pipeline over brainfuck source and finalizes the
+ * tape layout in <opts>. The source is left untouched so it can be
+ * compiled again under other options.
+ *
+ * @param source Brainfuck source, NUL-terminated
+ * @param len    Source length
+ * @param opts   Code generation options
+ * @param prog   Program to write the optimized IR to
+ *
+ * @return 0 on success, -1 if the source doesn't parse
+ */
+int bf_optimize_source(const char* source, int len, struct codegen_options* opts, struct bf_program* prog);
+
+/**
+ * Statically optimizes brainfuck source code. Modifies the buffer in-place.
+ *
+ * @param input_buf Brainfuck source buffer
+ * @param input_len Brainfuck source length
+ */
+void bf_static_optimize(char* input_buf, int input_len);
+
+/**
+ * Translates brainfuck source into intermediate form. Runs of identical
+ * operators are bundled into a single operation and loops are matched.
+ *
+ * @param input_buf Brainfuck source buffer
+ * @param input_len Brainfuck source length
+ * @param prog      Program to initialize
+ *
+ * @return 0 if the source was translated, -1 if an error occurred
+ */
+int bf_parse(const char* input_buf, int input_len, struct bf_program* prog);
+
+/**
+ * Appends an operation to a program.
+ *
+ * @param prog   Program to append to
+ * @param type   Operation type
+ * @param offset Cell offset
+ * @param arg    Operation argument
+ *
+ * @return Index of the new operation
+ */
+int bf_append(struct bf_program* prog, enum bf_op_type type, int offset, int arg);
+
+/**
+ * Appends a copy of an operation from another program, along with any lane
+ * data it refers to. Loop matches are left for bf_rematch().
+ *
+ * @param prog Program to append to
+ * @param from Program the operation belongs to
+ * @param op   Operation to copy
+ * @param move Pointer distance to add to the operation's cell offsets
+ *
+ * @return Index of the new operation
+ */
+int bf_append_copy(struct bf_program* prog, const struct bf_program* from, const struct bf_op* op, int move);
+
+/**
+ * Appends vector lane data to a program.
+ *
+ * @param prog Program to append to
+ * @param vec  Lane data
+ *
+ * @return Index of the new lane data, for the BF_OP_VEC match field
+ */
+int bf_append_vec(struct bf_program* prog, const struct bf_vec* vec);
+
+/**
+ * Recomputes the match indices of every loop in a program after a pass
+ * has rewritten its operations.
+ *
+ * @param prog Program to update
+ */
+void bf_rematch(struct bf_program* prog);
+
+/**
+ * Releases the operations held by a program.
+ *
+ * @param prog Program to free
+ */
+void bf_free(struct bf_program* prog);
+
+/**
+ * Folds each straight-line block into offset form. Pointer moves are
+ * deferred to the end of the block and cell updates are addressed by
+ * offset instead, merged per cell and sorted by offset. Input and output
+ * take the pending move as their offset rather than ending the block.
+ *
+ * @param prog Program to optimize in-place
+ */
+void bf_fold_blocks(struct bf_program* prog);
+
+/**
+ * Loop-invariant code motion. In loops whose body leaves the pointer where
+ * it found it, cells that are never read in the loop are moved out of it:
+ * constant stores are hoisted in front of the loop under a guard, and
+ * constant additions are turned into a single multiply-add by the trip
+ * count when the trip count can be derived from the condition cell. Loops
+ * left with nothing but a step of the condition cell become a clear.
+ *
+ * @param prog Program to optimize in-place
+ */
+void bf_hoist_invariants(struct bf_program* prog);
+
+/**
+ * Converts loops that run at most once into ifs. A loop runs at most once
+ * when its body leaves the pointer where it found it and always ends with
+ * the condition cell cleared, the usual brainfuck idiom for a conditional.
+ * Ifs drop the back edge and the second test of the condition cell.
+ *
+ * @param prog Program to optimize in-place
+ */
+void bf_convert_once_loops(struct bf_program* prog);
+
+/**
+ * Specializes the program on its known starting state. Everything before
+ * the first input is deterministic, so top-level operations are evaluated
+ * at compile time until one reads input, leaves the tape or runs into the
+ * evaluation limits. The evaluated prefix is replaced by its output and
+ * the resulting tape contents, which unrolls counter-driven loops
+ * completely.
+ *
+ * @param prog        Program to optimize in-place
+ * @param tape_length Number of cells in the tape
+ */
+void bf_evaluate_prefix(struct bf_program* prog, int tape_length);
+
+/**
+ * Groups runs of cell updates at neighbouring offsets into vector updates.
+ * Expects the sorted, merged updates produced by bf_fold_blocks().
+ *
+ * @param prog Program to optimize in-place
+ */
+void bf_vectorize(struct bf_program* prog);
+
+/**
+ * Computes the static tape extent of a program. The extent is known when
+ * every loop body leaves the pointer where it found it, in which case every
+ * cell access has a fixed position relative to the starting cell.
+ *
+ * @param prog Program to analyze
+ * @param min  Set to the lowest accessed cell relative to the starting cell
+ * @param max  Set to the highest accessed cell relative to the starting cell
+ *
+ * @return 0 if the extent is known, -1 otherwise
+ */
+int bf_tape_extent(const struct bf_program* prog, int* min, int* max);
+
+/**
+ * Computes the cost of one iteration of a loop for step limiting: the
+ * operations of its body plus the test. Inner loops count once, their
+ * own iterations are charged at their own back edges.
+ *
+ * @param prog Program to analyze
+ * @param loop Index of the BF_OP_LOOP
+ *
+ * @return Cost of an iteration, at least 1
+ */
+int bf_loop_cost(const struct bf_program* prog, int loop);
+
+/**
+ * Splits a program into regions of top-level operations for incremental
+ * builds. Regions end after top-level loops picked by a hash of their
+ * contents, so an edit only moves the boundaries next to it.
+ *
+ * @param prog   Program to split
+ * @param starts Set to an allocated array of region start indices
+ *
+ * @return Number of regions
+ */
+int bf_split_regions(const struct bf_program* prog, int** starts);
+
+/**
+ * Reads a branch profile written by a program built with -p.
+ *
+ * @param path    Profile path
+ * @param profile Profile to fill in
+ *
+ * @return 0 on success, -1 if the profile couldn't be read
+ */
+int bf_profile_load(const char* path, struct bf_profile* profile);
+
+/**
+ * Frees the sites of a branch profile.
+ *
+ * @param profile Profile to free
+ */
+void bf_profile_free(struct bf_profile* profile);
+
+/**
+ * Counts the branch sites of a program, which a profile of it must match.
+ *
+ * @param prog Program to count sites in
+ *
+ * @return Number of BF_OP_LOOP and BF_OP_IF operations
+ */
+int bf_profile_sites(const struct bf_program* prog);
+
+/**
+ * Writes the generated program prologue (includes, tape and runtime
+ * support declarations, and any functions outlined from the program) up
+ * to the opening of main().
+ *
+ * @param prog Program to generate code for
+ * @param opts Code generation options
+ * @param out  File to write generated code to
+ */
+void generate_c_prologue(const struct bf_program* prog, const struct codegen_options* opts, FILE* out);
+
+/**
+ * Generates a C function body from a program in intermediate form.
+ * Writes the generated C source code to <out>.
+ *
+ * @param prog Program to generate code for
+ * @param opts Code generation options
+ * @param out  File to write generated code to
+ *
+ * @return 0 if generation was successful, -1 if an error occurred
+ */
+int generate_c_source(const struct bf_program* prog, const struct codegen_options* opts, FILE* out);
+
+/**
+ * Writes the generated program epilogue, closing main().
+ *
+ * @param opts Code generation options
+ * @param out  File to write generated code to
+ */
+void generate_c_epilogue(const struct codegen_options* opts, FILE* out);
+
+/**
+ * Generates one region of an incremental build as a translation unit
+ * defining the function <name>. Regions share the tape and the pointer
+ * through globals defined by generate_c_region_main(), and don't use
+ * static cell positions, so their code only depends on their own
+ * operations.
+ *
+ * @param region Region operations, as a program of their own
+ * @param opts   Code generation options
+ * @param name   Name of the function to define
+ * @param out    File to write generated code to
+ *
+ * @return 0 if generation was successful, -1 if an error occurred
+ */
+int generate_c_region(const struct bf_program* region, const struct codegen_options* opts, const char* name, FILE* out);
+
+/**
+ * Generates the main translation unit of an incremental build, defining
+ * the tape and calling the region functions in order.
+ *
+ * @param opts  Code generation options
+ * @param names Region function names, in program order
+ * @param count Number of regions
+ * @param out   File to write generated code to
+ */
+void generate_c_region_main(const struct codegen_options* opts, const char* const* names, int count, FILE* out);
+
+/**
+ * Generates a complete LLVM IR module from a program in intermediate form.
+ * Writes the generated IR to <out>.
+ *
+ * @param prog Program to generate code for
+ * @param opts Code generation options
+ * @param out  File to write generated code to
+ *
+ * @return 0 if generation was successful, -1 if an error occurred
+ */
+int generate_llvm_source(const struct bf_program* prog, const struct codegen_options* opts, FILE* out);
+
+/**
+ * Generates a complete x86-64 GNU assembly module from a program in
+ * intermediate form. Writes the generated assembly to <out>.
+ *
+ * @param prog Program to generate code for
+ * @param opts Code generation options
+ * @param out  File to write generated code to
+ *
+ * @return 0 if generation was successful, -1 if an error occurred
+ */
+int generate_asm_source(const struct bf_program* prog, const struct codegen_options* opts, FILE* out);
+
+/**
+ * Writes a program in intermediate form back out as brainfuck source. The
+ * program must not contain BF_OP_MUL operations or guarded stores, which
+ * bf_hoist_invariants() introduces.
+ *
+ * @param prog Program to generate code for
+ * @param opts Code generation options
+ * @param out  File to write generated code to
+ *
+ * @return 0 if generation was successful, -1 if an error occurred
+ */
+int generate_bf_source(const struct bf_program* prog, const struct codegen_options* opts, FILE* out);
+
+/**
+ * Builds a program in intermediate form through libgccjit and compiles it
+ * to an executable in-process. Fails unless bfoc was built with GCCJIT=1.
+ *
+ * @param prog        Program to generate code for
+ * @param opts        Code generation options
+ * @param runtime_dir Directory holding the runtime libraries
+ * @param output      Output binary path
+ *
+ * @return 0 if compilation was successful, -1 if an error occurred
+ */
+int generate_gccjit_binary(const struct bf_program* prog, const struct codegen_options* opts, const char* runtime_dir, const char* output);
+
+/**
+ * Describes everything a compiled program depends on, for use as a compile
+ * cache key: the optimized IR, the code generation options, the backend,
+ * the host machine, its CPU for native builds, the toolchain and the
+ * runtime library.
+ *
+ * @param prog        Optimized program
+ * @param opts        Code generation options
+ * @param runtime_dir Directory holding the runtime libraries
+ * @param toolchain   Toolchain description from bf_cache_toolchain()
+ * @param key         Buffer to write the key to
+ * @param size        Buffer size
+ *
+ * @return 0 on success, -1 if the build can't be cached because the host
+ *         CPU of a native build or the runtime library can't be identified
+ */
+int bf_cache_key(const struct bf_program* prog, const struct codegen_options* opts, const char* runtime_dir, const char* toolchain, char* key, int size);
+
+/**
+ * Identifies the toolchain a build depends on: the running bfoc binary, by
+ * its size and mtime, and the output of `--version` from each external
+ * tool the backend runs.
+ *
+ * @param tools NULL-terminated list of executable names
+ * @param buf   Buffer to write the description to
+ * @param size  Buffer size
+ *
+ * @return 0 on success, -1 if bfoc or a tool can't be identified
+ */
+int bf_cache_toolchain(const char* const* tools, char* buf, int size);
+
+/**
+ * Copies a cached binary to <output> if the cache holds one for <key>.
+ *
+ * @param dir    Cache directory
+ * @param key    Cache key from bf_cache_key()
+ * @param output Output binary path
+ *
+ * @return 0 if the binary was reused, -1 otherwise
+ */
+int bf_cache_fetch(const char* dir, const char* key, const char* output);
+
+/**
+ * Stores a freshly compiled binary in the cache under <key>, creating the
+ * cache directory if needed.
+ *
+ * @param dir    Cache directory
+ * @param key    Cache key from bf_cache_key()
+ * @param output Compiled binary path
+ *
+ * @return 0 if the binary was stored, -1 otherwise
+ */
+int bf_cache_store(const char* dir, const char* key, const char* output);
+
+/**
+ * Describes a program source and the options that don't take part in
+ * tuning, for use as the key of a tuned configuration.
+ *
+ * @param source Brainfuck source buffer
+ * @param len    Brainfuck source length
+ * @param opts   Code generation options
+ * @param key    Buffer to write the key to
+ * @param size   Buffer size
+ *
+ * @return 0 on success, -1 if the host CPU can't be identified
+ */
+int bf_cache_tuning_key(const char* source, int len, const struct codegen_options* opts, char* key, int size);
+
+/**
+ * Applies the tuned configuration recorded for <key>, if there is one.
+ *
+ * @param dir  Cache directory
+ * @param key  Key from bf_cache_tuning_key()
+ * @param opts Options to apply the tuning knobs to
+ *
+ * @return 0 if a configuration was applied, -1 otherwise
+ */
+int bf_cache_fetch_tuning(const char* dir, const char* key, struct codegen_options* opts);
+
+/**
+ * Records the tuning knobs of <opts> as the tuned configuration for <key>.
+ *
+ * @param dir  Cache directory
+ * @param key  Key from bf_cache_tuning_key()
+ * @param opts Tuned options
+ *
+ * @return 0 if the configuration was recorded, -1 otherwise
+ */
+int bf_cache_store_tuning(const char* dir, const char* key, const struct codegen_options* opts);
+
+/**
+ * Computes the function name and cache key of the compiled object for one
+ * region of an incremental build. Both depend only on the region's
+ * operations and the options its code depends on.
+ *
+ * @param region    Region operations
+ * @param opts      Code generation options
+ * @param toolchain Toolchain description from bf_cache_toolchain()
+ * @param name      Buffer to write the function name to
+ * @param name_size Name buffer size
+ * @param key       Buffer to write the key to
+ * @param size      Key buffer size
+ *
+ * @return 0 on success, -1 if the object can't be cached because the host
+ *         CPU of a native build can't be identified
+ */
+int bf_cache_region_key(const struct bf_program* region, const struct codegen_options* opts, const char* toolchain, char* name, int name_size, char* key, int size);
+
+/**
+ * Writes a string to <out> as a quoted and escaped C string literal.
+ *
+ * @param str String to write
+ * @param out File to write to
+ */
+void write_c_string(const char* str, FILE* out);
+
+#endif
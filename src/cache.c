@@ -0,0 +1,470 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * On-disk cache of compiled programs. Entries are keyed by a description
+ * of everything the binary depends on: the optimized IR, the code
+ * generation options, the backend, the host machine, the toolchain and the
+ * runtime library it was linked against. Each entry starts with that
+ * description as a header line, which is compared in full on lookup, so a
+ * collision of the entry file names or a stale entry is never reused. The
+ * IR and options are only described by 64-bit hashes, so two programs
+ * whose hashes collide would share an entry; that is possible but very
+ * unlikely.
+ *
+ * The cache also records the configuration the autotuner picked for each
+ * program source, and the compiled objects of incremental build regions,
+ * in entries of their own.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bfoc.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#define CACHE_FORMAT   1
+#define FNV_OFFSET     14695981039346656037ULL
+#define FNV_PRIME      1099511628211ULL
+
+/**
+ * Adds bytes to an FNV-1a hash.
+ *
+ * @param hash Running hash
+ * @param data Bytes to add
+ * @param len  Number of bytes
+ * @return     Updated hash
+ */
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t len);
+
+/**
+ * Adds an integer to an FNV-1a hash.
+ *
+ * @param hash  Running hash
+ * @param value Integer to add
+ * @return      Updated hash
+ */
+static uint64_t hash_int(uint64_t hash, int value);
+
+/**
+ * Describes the host a build is for: its machine name, and for builds
+ * tuned to the host CPU also that CPU's model and feature flags, which
+ * other CPUs of the same machine may lack.
+ *
+ * @param native Nonzero if the build targets the host CPU
+ * @param buf    Buffer to write the description to
+ * @param size   Buffer size
+ * @return       0 on success, -1 if the CPU of a native build can't be identified
+ */
+static int describe_host(int native, char* buf, int size);
+
+/**
+ * Formats the path of the cache entry for a key.
+ *
+ * @param dir  Cache directory
+ * @param key  Cache key
+ * @param buf  Buffer to write the path to
+ * @param size Buffer size
+ */
+static void entry_path(const char* dir, const char* key, char* buf, int size);
+
+/**
+ * Copies the rest of one stream to another.
+ *
+ * @param in  Stream to read
+ * @param out Stream to write
+ * @return    0 on success, -1 on a read or write error
+ */
+static int copy_stream(FILE* in, FILE* out);
+
+int bf_cache_key(const struct bf_program* prog, const struct codegen_options* opts, const char* runtime_dir, const char* toolchain, char* key, int size) {
+    uint64_t hash = FNV_OFFSET;
+    char library[4096], host[64];
+    struct stat st;
+
+    for (int i = 0; i < prog->len; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+
+        hash = hash_int(hash, op->type);
+        hash = hash_int(hash, op->offset);
+        hash = hash_int(hash, op->arg);
+        hash = hash_int(hash, op->src);
+
+        if (op->type == BF_OP_VEC) {
+            hash = hash_bytes(hash, &prog->vecs[op->match], sizeof prog->vecs[op->match]);
+        }
+    }
+
+    hash = hash_int(hash, opts->tape_length);
+    hash = hash_int(hash, opts->wrap);
+    hash = hash_int(hash, opts->prefault);
+    hash = hash_int(hash, opts->lock);
+    hash = hash_int(hash, opts->extent_known);
+    hash = hash_int(hash, opts->extent_min);
+    hash = hash_int(hash, opts->extent_max);
+    hash = hash_bytes(hash, &opts->step_limit, sizeof opts->step_limit);
+    hash = hash_int(hash, opts->incremental);
+
+    hash = hash_int(hash, opts->opt_level);
+    hash = hash_int(hash, opts->native);
+    hash = hash_int(hash, opts->no_cell_cache);
+    hash = hash_int(hash, opts->no_vectorize);
+
+    if (opts->heatmap_path) {
+        hash = hash_bytes(hash, opts->heatmap_path, strlen(opts->heatmap_path) + 1);
+    }
+
+    if (opts->profile_path) {
+        hash = hash_bytes(hash, opts->profile_path, strlen(opts->profile_path) + 1);
+    }
+
+    if (opts->profile) {
+        hash = hash_bytes(hash, opts->profile->sites, sizeof *opts->profile->sites * opts->profile->len);
+    }
+
+    /* The runtime library is linked in statically and identified by its
+     * size and mtime. */
+    if (describe_host(opts->native, host, sizeof host)) {
+        return -1;
+    }
+
+    snprintf(library, sizeof library, "%s/%s", runtime_dir,
+             opts->runtime == RUNTIME_NOSTDLIB ? "libbfocrt-nostdlib.a" : opts->runtime == RUNTIME_REPLAY ? "libbfocrt-replay.a" : "libbfocrt.a");
+
+    if (stat(library, &st)) {
+        return -1;
+    }
+
+    snprintf(key, size, "bfoc-cache %d ir=%016llx %s %s backend=%d runtime=%d rtlib=%lld-%lld",
+             CACHE_FORMAT, (unsigned long long) hash, host, toolchain, opts->backend, opts->runtime,
+             (long long) st.st_size, (long long) st.st_mtime);
+
+    return 0;
+}
+
+int bf_cache_toolchain(const char* const* tools, char* buf, int size) {
+    uint64_t hash = FNV_OFFSET;
+    char command[4096], line[4096];
+    struct stat st;
+
+    /* bfoc itself generates the code, a rebuilt bfoc may generate
+     * different code for the same IR. */
+    if (stat("/proc/self/exe", &st)) {
+        return -1;
+    }
+
+    for (; *tools; ++tools) {
+        int lines = 0;
+
+        snprintf(command, sizeof command, "%s --version 2>/dev/null", *tools);
+        hash = hash_bytes(hash, *tools, strlen(*tools) + 1);
+
+        FILE* version = popen(command, "r");
+
+        if (!version) {
+            return -1;
+        }
+
+        while (fgets(line, sizeof line, version)) {
+            hash = hash_bytes(hash, line, strlen(line));
+            ++lines;
+        }
+
+        if (pclose(version) || !lines) {
+            return -1;
+        }
+    }
+
+    snprintf(buf, size, "bfoc=%lld-%lld tools=%016llx", (long long) st.st_size, (long long) st.st_mtime, (unsigned long long) hash);
+    return 0;
+}
+
+int bf_cache_fetch(const char* dir, const char* key, const char* output) {
+    char path[4096], header[512];
+
+    entry_path(dir, key, path, sizeof path);
+
+    FILE* entry = fopen(path, "rb");
+
+    if (!entry) {
+        return -1;
+    }
+
+    if (!fgets(header, sizeof header, entry) || strncmp(header, key, strlen(key)) || header[strlen(key)] != '\n') {
+        fclose(entry);
+        return -1;
+    }
+
+    FILE* out = fopen(output, "wb");
+
+    if (!out) {
+        fprintf(stderr, "error: couldn't open %s for writing: %s\n", output, strerror(errno));
+        fclose(entry);
+        return -1;
+    }
+
+    int status = copy_stream(entry, out);
+
+    fclose(entry);
+
+    if (fclose(out) || status || chmod(output, 0755)) {
+        unlink(output);
+        return -1;
+    }
+
+    return 0;
+}
+
+int bf_cache_store(const char* dir, const char* key, const char* output) {
+    char path[4096], tmp[4096 + 32];
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "warning: couldn't create cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    entry_path(dir, key, path, sizeof path);
+    snprintf(tmp, sizeof tmp, "%s.%ld", path, (long) getpid());
+
+    FILE* in = fopen(output, "rb");
+    FILE* entry = in ? fopen(tmp, "wb") : NULL;
+
+    if (!entry) {
+        fprintf(stderr, "warning: couldn't write cache entry %s: %s\n", path, strerror(errno));
+        if (in) fclose(in);
+        return -1;
+    }
+
+    fprintf(entry, "%s\n", key);
+    int status = copy_stream(in, entry);
+
+    fclose(in);
+
+    /* Entries appear atomically, concurrent builds never see half of one. */
+    if (fclose(entry) || status || rename(tmp, path)) {
+        fprintf(stderr, "warning: couldn't write cache entry %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+int bf_cache_tuning_key(const char* source, int len, const struct codegen_options* opts, char* key, int size) {
+    uint64_t hash = hash_bytes(FNV_OFFSET, source, len);
+    char host[64];
+
+    hash = hash_int(hash, opts->tape_length);
+    hash = hash_int(hash, opts->wrap);
+    hash = hash_int(hash, opts->prefault);
+    hash = hash_int(hash, opts->lock);
+    hash = hash_int(hash, opts->runtime);
+    hash = hash_bytes(hash, &opts->step_limit, sizeof opts->step_limit);
+    hash = hash_int(hash, !!opts->heatmap_path);
+    hash = hash_int(hash, !!opts->profile_path);
+
+    if (opts->profile) {
+        hash = hash_bytes(hash, opts->profile->sites, sizeof *opts->profile->sites * opts->profile->len);
+    }
+
+    /* The autotuner tries native builds, so the choice is specific to the
+     * host CPU. */
+    if (describe_host(1, host, sizeof host)) {
+        return -1;
+    }
+
+    snprintf(key, size, "bfoc-tune %d source=%016llx %s", CACHE_FORMAT, (unsigned long long) hash, host);
+
+    return 0;
+}
+
+int bf_cache_fetch_tuning(const char* dir, const char* key, struct codegen_options* opts) {
+    char path[4096], header[512];
+    int backend, opt_level, native, no_cell_cache, no_vectorize;
+
+    entry_path(dir, key, path, sizeof path);
+
+    FILE* entry = fopen(path, "r");
+
+    if (!entry) {
+        return -1;
+    }
+
+    int status = !fgets(header, sizeof header, entry) || strncmp(header, key, strlen(key)) || header[strlen(key)] != '\n'
+        || fscanf(entry, "%d %d %d %d %d", &backend, &opt_level, &native, &no_cell_cache, &no_vectorize) != 5;
+
+    fclose(entry);
+
+    /* A damaged or foreign entry is a miss, not a configuration. */
+    if (status || backend < BACKEND_C || backend > BACKEND_BF || opt_level < 0 || opt_level > 3) {
+        return -1;
+    }
+
+    opts->backend = backend;
+    opts->opt_level = opt_level;
+    opts->native = native;
+    opts->no_cell_cache = no_cell_cache;
+    opts->no_vectorize = no_vectorize;
+
+    return 0;
+}
+
+int bf_cache_store_tuning(const char* dir, const char* key, const struct codegen_options* opts) {
+    char path[4096], tmp[4096 + 32];
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "warning: couldn't create cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    entry_path(dir, key, path, sizeof path);
+    snprintf(tmp, sizeof tmp, "%s.%ld", path, (long) getpid());
+
+    FILE* entry = fopen(tmp, "w");
+
+    if (!entry) {
+        fprintf(stderr, "warning: couldn't write cache entry %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(entry, "%s\n%d %d %d %d %d\n", key, opts->backend, opts->opt_level, opts->native, opts->no_cell_cache, opts->no_vectorize);
+
+    if (fclose(entry) || rename(tmp, path)) {
+        fprintf(stderr, "warning: couldn't write cache entry %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+int bf_cache_region_key(const struct bf_program* region, const struct codegen_options* opts, const char* toolchain, char* name, int name_size, char* key, int size) {
+    uint64_t hash = FNV_OFFSET, options = FNV_OFFSET;
+    char host[64];
+
+    for (int i = 0; i < region->len; ++i) {
+        const struct bf_op* op = &region->ops[i];
+
+        hash = hash_int(hash, op->type);
+        hash = hash_int(hash, op->offset);
+        hash = hash_int(hash, op->arg);
+        hash = hash_int(hash, op->src);
+
+        if (op->type == BF_OP_VEC) {
+            hash = hash_bytes(hash, &region->vecs[op->match], sizeof region->vecs[op->match]);
+        }
+    }
+
+    /* Only the options the region's code and compile depend on. The step
+     * budget and tape size live in the main translation unit. */
+    options = hash_int(options, opts->wrap ? opts->tape_length : 0);
+    options = hash_int(options, !!opts->step_limit);
+    options = hash_int(options, opts->no_cell_cache);
+    options = hash_int(options, opts->opt_level);
+    options = hash_int(options, opts->native);
+    options = hash_int(options, opts->runtime == RUNTIME_NOSTDLIB);
+
+    snprintf(name, name_size, "bfoc_region_%016llx", (unsigned long long) hash);
+
+    if (describe_host(opts->native, host, sizeof host)) {
+        return -1;
+    }
+
+    snprintf(key, size, "bfoc-region %d ir=%016llx options=%016llx %s %s",
+             CACHE_FORMAT, (unsigned long long) hash, (unsigned long long) options, host, toolchain);
+
+    return 0;
+}
+
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ ((const unsigned char*) data)[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+uint64_t hash_int(uint64_t hash, int value) {
+    return hash_bytes(hash, &value, sizeof value);
+}
+
+int describe_host(int native, char* buf, int size) {
+    /* The /proc/cpuinfo fields naming the CPU and its features, on x86
+     * and ARM. Clock speeds and the like vary and are left out. */
+    static const char* const fields[] = {
+        "vendor_id", "cpu family", "model", "model name", "stepping", "flags",
+        "CPU implementer", "CPU architecture", "CPU variant", "CPU part", "CPU revision", "Features",
+    };
+    struct utsname host;
+    char line[16384];
+    uint64_t cpu = FNV_OFFSET;
+    int found = 0;
+
+    if (uname(&host)) {
+        strcpy(host.machine, "unknown");
+    }
+
+    /* Other builds target the architecture as a whole. */
+    if (!native) {
+        snprintf(buf, size, "machine=%s", host.machine);
+        return 0;
+    }
+
+    FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+
+    if (!cpuinfo) {
+        return -1;
+    }
+
+    /* The first processor's entry, up to the blank line, stands for all. */
+    while (fgets(line, sizeof line, cpuinfo) && *line != '\n') {
+        char* colon = strchr(line, ':');
+        int len;
+
+        if (!colon) {
+            continue;
+        }
+
+        for (len = colon - line; len && (line[len - 1] == ' ' || line[len - 1] == '\t'); --len);
+
+        for (int i = 0; i < (int) (sizeof fields / sizeof *fields); ++i) {
+            if ((int) strlen(fields[i]) == len && !strncmp(line, fields[i], len)) {
+                cpu = hash_bytes(cpu, line, strlen(line));
+                ++found;
+            }
+        }
+    }
+
+    fclose(cpuinfo);
+
+    if (!found) {
+        return -1;
+    }
+
+    snprintf(buf, size, "machine=%s cpu=%016llx", host.machine, (unsigned long long) cpu);
+    return 0;
+}
+
+void entry_path(const char* dir, const char* key, char* buf, int size) {
+    snprintf(buf, size, "%s/%016llx", dir, (unsigned long long) hash_bytes(FNV_OFFSET, key, strlen(key)));
+}
+
+int copy_stream(FILE* in, FILE* out) {
+    char buf[65536];
+    size_t n;
+
+    while ((n = fread(buf, 1, sizeof buf, in))) {
+        if (fwrite(buf, 1, n, out) != n) {
+            return -1;
+        }
+    }
+
+    return ferror(in) ? -1 : 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * x86-64 assembly code generator. Emits AT&T syntax for the GNU assembler.
+ *
+ * The tape pointer is pinned in %rbx, which survives the calls into the
+ * runtime. On circular tapes %rbx holds the tape index instead and the tape
+ * base is pinned in %r12. %rcx holds masked cell indices, %eax values.
+ */
+
+#include "bfoc.h"
+
+/**
+ * Assembly code generator state.
+ */
+struct asm_codegen {
+    const struct codegen_options* opts;
+    FILE* out;
+    int length;   /* Number of cells in the tape array */
+    int absolute; /* Cell positions are static, address the tape directly */
+    int mask;     /* Tape index mask for circular tapes, 0 otherwise */
+    int pos;      /* Tape index of the current cell in absolute mode */
+};
+
+/**
+ * Formats a memory operand for the cell at <offset> from the current
+ * pointer position. On circular tapes this first emits the index
+ * computation into %rcx, so one operand can be live at a time.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset
+ * @param buf    Buffer to write the operand to
+ * @param size   Buffer size
+ */
+static void cell_operand(const struct asm_codegen* cg, int offset, char* buf, int size);
+
+/**
+ * Writes a vector cell update as an SSE load, mask, add and store of 4, 8
+ * or 16 lanes. All-clear vectors are a single store of a zeroed register.
+ *
+ * @param cg Code generator state
+ * @param op BF_OP_VEC operation
+ * @param i  Operation index, naming the lane constants
+ * @param vec Lane data
+ */
+static void emit_vec(const struct asm_codegen* cg, const struct bf_op* op, int i, const struct bf_vec* vec);
+
+/**
+ * Writes the read-only lane constants used by a vector update.
+ *
+ * @param cg  Code generator state
+ * @param op  BF_OP_VEC operation
+ * @param i   Operation index, naming the lane constants
+ * @param vec Lane data
+ */
+static void emit_vec_constants(const struct asm_codegen* cg, const struct bf_op* op, int i, const struct bf_vec* vec);
+
+/**
+ * Returns an 8-bit immediate as a signed value.
+ *
+ * @param value Immediate, taken modulo 256
+ */
+static int imm8(int value);
+
+int generate_asm_source(const struct bf_program* prog, const struct codegen_options* opts, FILE* out) {
+#ifndef __x86_64__
+    fprintf(stderr, "error: the asm backend supports x86-64 only\n");
+    return -1;
+#endif
+
+    char ref[32], src[32];
+    struct asm_codegen cg = {
+        .opts     = opts,
+        .out      = out,
+        .length   = opts->tape_length,
+        .absolute = opts->extent_known,
+        .mask     = opts->wrap ? opts->tape_length - 1 : 0,
+        .pos      = opts->extent_known ? -opts->extent_min : 0,
+    };
+
+    if (opts->extent_known) {
+        cg.length = opts->extent_max - opts->extent_min + 1;
+    }
+
+    fprintf(out, "\t.local tape\n\t.comm tape, %d, 64\n\n", cg.length);
+
+    /* Step budget, charged at loop back edges. */
+    if (opts->step_limit) {
+        fprintf(out, "\t.data\n\t.balign 8\nsteps:\n\t.quad %ld\n\n", opts->step_limit);
+    }
+    fprintf(out, "\t.text\n\t.globl main\n\t.type main, @function\nmain:\n");
+
+    /* Three pushes leave the stack aligned for calls. */
+    fprintf(out, "\tpush %%rbx\n\tpush %%r12\n\tpush %%rbp\n");
+
+    if (opts->prefault) {
+        fprintf(out, "\tmov $%d, %%edi\n\tcall bfrt_prefault_output@PLT\n", opts->lock);
+        fprintf(out, "\tlea tape(%%rip), %%rdi\n\tmov $%d, %%esi\n\tmov $%d, %%edx\n\tcall bfrt_prefault@PLT\n", cg.length, opts->lock);
+    }
+
+    if (!cg.absolute && cg.mask) {
+        fprintf(out, "\tlea tape(%%rip), %%r12\n\txor %%ebx, %%ebx\n");
+    } else {
+        fprintf(out, "\tlea tape(%%rip), %%rbx\n");
+    }
+
+    for (int i = 0; i < prog->len; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+
+        switch (op->type) {
+        case BF_OP_ADD:
+            cell_operand(&cg, op->offset, ref, sizeof ref);
+            fprintf(out, "\taddb $%d, %s\n", imm8(op->arg), ref);
+            break;
+        case BF_OP_SET:
+            cell_operand(&cg, op->offset, ref, sizeof ref);
+            fprintf(out, "\tmovb $%d, %s\n", imm8(op->arg), ref);
+            break;
+        case BF_OP_MOVE:
+            if (cg.absolute) {
+                cg.pos += op->arg;
+            } else if (cg.mask) {
+                fprintf(out, "\tadd $%d, %%rbx\n\tand $%d, %%rbx\n", op->arg, cg.mask);
+            } else {
+                fprintf(out, "\tadd $%d, %%rbx\n", op->arg);
+            }
+            break;
+        case BF_OP_OUTPUT:
+            cell_operand(&cg, op->offset, ref, sizeof ref);
+            fprintf(out, "\tmovzbl %s, %%edi\n\tcall putchar@PLT\n", ref);
+            break;
+        case BF_OP_INPUT:
+            fprintf(out, "\tcall getchar@PLT\n");
+            cell_operand(&cg, op->offset, ref, sizeof ref);
+            fprintf(out, "\tmovb %%al, %s\n", ref);
+            break;
+        case BF_OP_LOOP:
+            /* Loops are rotated: one test on entry, then one at the bottom
+             * of every iteration. */
+            cell_operand(&cg, op->offset, ref, sizeof ref);
+            fprintf(out, "\tcmpb $0, %s\n\tje .Lexit%d\n.Lbody%d:\n", ref, i, i);
+            break;
+        case BF_OP_END:
+            if (opts->step_limit) {
+                fprintf(out, "\tsubq $%d, steps(%%rip)\n\tjs .Lsteps\n", bf_loop_cost(prog, op->match));
+            }
+
+            cell_operand(&cg, prog->ops[op->match].offset, ref, sizeof ref);
+            fprintf(out, "\tcmpb $0, %s\n\tjne .Lbody%d\n.Lexit%d:\n", ref, op->match, op->match);
+            break;
+        case BF_OP_MUL:
+            cell_operand(&cg, op->src, src, sizeof src);
+
+            if (op->arg == 1 || op->arg == -1) {
+                fprintf(out, "\tmovb %s, %%al\n", src);
+            } else {
+                fprintf(out, "\tmovzbl %s, %%eax\n\timul $%d, %%eax, %%eax\n", src, imm8(op->arg));
+            }
+
+            cell_operand(&cg, op->offset, ref, sizeof ref);
+            fprintf(out, "\t%s %%al, %s\n", op->arg == -1 ? "subb" : "addb", ref);
+            break;
+        case BF_OP_IF:
+            cell_operand(&cg, op->offset, ref, sizeof ref);
+            fprintf(out, "\tcmpb $0, %s\n\tje .Lendif%d\n", ref, i);
+            break;
+        case BF_OP_ENDIF:
+            fprintf(out, ".Lendif%d:\n", op->match);
+            break;
+        case BF_OP_VEC:
+            emit_vec(&cg, op, i, &prog->vecs[op->match]);
+            break;
+        }
+    }
+
+    fprintf(out, "\txor %%eax, %%eax\n\tpop %%rbp\n\tpop %%r12\n\tpop %%rbx\n\tret\n");
+
+    /* Jumped to from inside main(), where the stack is aligned for calls. */
+    if (opts->step_limit) {
+        fprintf(out, ".Lsteps:\n\tcall bfrt_out_of_steps@PLT\n");
+    }
+
+    fprintf(out, "\t.size main, .-main\n\n");
+
+    fprintf(out, "\t.section .rodata\n\t.balign 16\n");
+
+    for (int i = 0; i < prog->len; ++i) {
+        if (prog->ops[i].type == BF_OP_VEC) {
+            emit_vec_constants(&cg, &prog->ops[i], i, &prog->vecs[prog->ops[i].match]);
+        }
+    }
+
+    fprintf(out, "\n\t.section .note.GNU-stack,\"\",@progbits\n");
+
+    return 0;
+}
+
+void cell_operand(const struct asm_codegen* cg, int offset, char* buf, int size) {
+    if (cg->absolute) {
+        snprintf(buf, size, "%d(%%rbx)", cg->pos + offset);
+    } else if (cg->mask && offset) {
+        fprintf(cg->out, "\tlea %d(%%rbx), %%rcx\n\tand $%d, %%rcx\n", offset, cg->mask);
+        snprintf(buf, size, "(%%r12,%%rcx)");
+    } else if (cg->mask) {
+        snprintf(buf, size, "(%%r12,%%rbx)");
+    } else {
+        snprintf(buf, size, "%d(%%rbx)", offset);
+    }
+}
+
+void emit_vec(const struct asm_codegen* cg, const struct bf_op* op, int i, const struct bf_vec* vec) {
+    const char* mov = op->arg == 16 ? "movdqu" : op->arg == 8 ? "movq" : "movd";
+    char ref[32];
+    int adds = 0, sets = 0, zero = 1;
+
+    for (int lane = 0; lane < op->arg; ++lane) {
+        if (vec->mask[lane]) ++adds; else ++sets;
+        if (vec->mask[lane] || vec->add[lane]) zero = 0;
+    }
+
+    /* A circular tape can wrap in the middle of the vector. */
+    if (cg->mask && !cg->absolute) {
+        for (int lane = 0; lane < op->arg; ++lane) {
+            if (vec->mask[lane] == 0xff && !vec->add[lane]) {
+                continue;
+            }
+
+            cell_operand(cg, op->offset + lane, ref, sizeof ref);
+            fprintf(cg->out, "\t%s $%d, %s\n", vec->mask[lane] ? "addb" : "movb", imm8(vec->add[lane]), ref);
+        }
+
+        return;
+    }
+
+    cell_operand(cg, op->offset, ref, sizeof ref);
+
+    if (zero) {
+        fprintf(cg->out, "\tpxor %%xmm0, %%xmm0\n");
+    } else if (adds) {
+        fprintf(cg->out, "\t%s %s, %%xmm0\n", mov, ref);
+        if (sets) fprintf(cg->out, "\tpand .Lmask%d(%%rip), %%xmm0\n", i);
+        fprintf(cg->out, "\tpaddb .Ladd%d(%%rip), %%xmm0\n", i);
+    } else {
+        fprintf(cg->out, "\tmovdqa .Ladd%d(%%rip), %%xmm0\n", i);
+    }
+
+    fprintf(cg->out, "\t%s %%xmm0, %s\n", mov, ref);
+}
+
+void emit_vec_constants(const struct asm_codegen* cg, const struct bf_op* op, int i, const struct bf_vec* vec) {
+    /* SSE memory operands must be 16-byte aligned, so every constant is
+     * padded to a full register. */
+    fprintf(cg->out, ".Lmask%d:\n\t.byte ", i);
+
+    for (int lane = 0; lane < BF_VEC_MAX_LANES; ++lane) {
+        fprintf(cg->out, "%s%d", lane ? ", " : "", lane < op->arg ? vec->mask[lane] : 0);
+    }
+
+    fprintf(cg->out, "\n.Ladd%d:\n\t.byte ", i);
+
+    for (int lane = 0; lane < BF_VEC_MAX_LANES; ++lane) {
+        fprintf(cg->out, "%s%d", lane ? ", " : "", lane < op->arg ? vec->add[lane] : 0);
+    }
+
+    fprintf(cg->out, "\n");
+}
+
+int imm8(int value) {
+    value &= 0xff;
+    return value < 128 ? value : value - 256;
+}
@@ -0,0 +1,244 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Brainfuck code generator. Writes the optimized program back out as
+ * canonical brainfuck for interpreters bfoc can't replace: comments are
+ * gone, pointer moves are made only when a cell is reached, updates are
+ * the shortest run of + or - modulo 256, loops on cells known to be zero
+ * are dropped and so are the updates after the last loop or I/O.
+ *
+ * Multiplies and guarded stores have no brainfuck form without scratch
+ * cells, so programs for this backend are optimized without the passes
+ * that produce them.
+ */
+
+#include "bfoc.h"
+
+#include <stdlib.h>
+
+#define BF_LINE_LENGTH 80
+
+/**
+ * Brainfuck code generator state. One cell's value is tracked at a time,
+ * plus the cells left untouched before the first loop, which are zero.
+ */
+struct bf_codegen {
+    FILE* out;
+    int pos;         /* Emitted pointer position relative to the IR pointer */
+    int column;      /* Commands written on the current line */
+    int known;       /* Offset of the cell with a known value */
+    int known_value; /* Its value, -1 if no value is known */
+    int fresh;       /* No loop has been entered yet */
+    int base;        /* IR pointer relative to the starting cell, while fresh */
+    int touched;     /* Nonzero once a cell has been written */
+    int touched_min; /* Lowest cell written, relative to the starting cell */
+    int touched_max; /* Highest cell written, relative to the starting cell */
+};
+
+/**
+ * Writes a command some number of times, wrapping lines.
+ *
+ * @param cg    Code generator state
+ * @param c     Command
+ * @param count Number of times to write it
+ */
+static void emit(struct bf_codegen* cg, char c, int count);
+
+/**
+ * Moves the emitted pointer to a cell.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset relative to the IR pointer
+ */
+static void move_to(struct bf_codegen* cg, int offset);
+
+/**
+ * Adds a constant to a cell.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset relative to the IR pointer
+ * @param value  Constant, taken modulo 256
+ */
+static void emit_add(struct bf_codegen* cg, int offset, int value);
+
+/**
+ * Sets a cell to a constant, as a difference from its old value if that is
+ * known.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset relative to the IR pointer
+ * @param value  Constant, taken modulo 256
+ */
+static void emit_set(struct bf_codegen* cg, int offset, int value);
+
+/**
+ * Returns the value of a cell if it is known at this point, -1 otherwise.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset relative to the IR pointer
+ */
+static int cell_value(const struct bf_codegen* cg, int offset);
+
+/**
+ * Records a write to a cell.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset relative to the IR pointer
+ * @param value  New value, -1 if unknown
+ */
+static void cell_write(struct bf_codegen* cg, int offset, int value);
+
+int generate_bf_source(const struct bf_program* prog, const struct codegen_options* opts, FILE* out) {
+    struct bf_codegen cg = { .out = out, .known_value = -1, .fresh = 1 };
+    int end = prog->len;
+
+    /* Updates after the last loop or I/O are never observed. */
+    while (end && (prog->ops[end - 1].type == BF_OP_ADD || prog->ops[end - 1].type == BF_OP_SET
+                   || prog->ops[end - 1].type == BF_OP_MOVE || prog->ops[end - 1].type == BF_OP_VEC)) {
+        --end;
+    }
+
+    for (int i = 0; i < end; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+        const struct bf_vec* vec;
+
+        switch (op->type) {
+        case BF_OP_ADD:
+            emit_add(&cg, op->offset, op->arg);
+            break;
+        case BF_OP_SET:
+            emit_set(&cg, op->offset, op->arg);
+            break;
+        case BF_OP_MOVE:
+            cg.pos -= op->arg;
+            cg.known -= op->arg;
+            cg.base += op->arg;
+            break;
+        case BF_OP_OUTPUT:
+            move_to(&cg, op->offset);
+            emit(&cg, '.', 1);
+            break;
+        case BF_OP_INPUT:
+            move_to(&cg, op->offset);
+            emit(&cg, ',', 1);
+            cell_write(&cg, op->offset, -1);
+            break;
+        case BF_OP_LOOP:
+        case BF_OP_IF:
+            /* A loop on a zero cell never runs. */
+            if (!cell_value(&cg, op->offset)) {
+                i = op->match;
+                break;
+            }
+
+            move_to(&cg, op->offset);
+            emit(&cg, '[', 1);
+            cg.fresh = 0;
+            cg.known_value = -1;
+            break;
+        case BF_OP_END:
+        case BF_OP_ENDIF:
+            /* Once-loops leave their condition zero, so one pass through
+             * the body ends them too. */
+            move_to(&cg, prog->ops[op->match].offset);
+            emit(&cg, ']', 1);
+            cell_write(&cg, cg.pos, 0);
+            break;
+        case BF_OP_VEC:
+            vec = &prog->vecs[op->match];
+
+            for (int lane = 0; lane < op->arg; ++lane) {
+                if (!vec->mask[lane]) {
+                    emit_set(&cg, op->offset + lane, vec->add[lane]);
+                } else if (vec->add[lane]) {
+                    emit_add(&cg, op->offset + lane, vec->add[lane]);
+                }
+            }
+            break;
+        case BF_OP_MUL:
+            fprintf(stderr, "error: multiplies can't be written as brainfuck\n");
+            return -1;
+        }
+    }
+
+    if (cg.column) {
+        fputc('\n', out);
+    }
+
+    return 0;
+}
+
+void emit(struct bf_codegen* cg, char c, int count) {
+    while (count--) {
+        fputc(c, cg->out);
+
+        if (++cg->column == BF_LINE_LENGTH) {
+            fputc('\n', cg->out);
+            cg->column = 0;
+        }
+    }
+}
+
+void move_to(struct bf_codegen* cg, int offset) {
+    emit(cg, offset > cg->pos ? '>' : '<', abs(offset - cg->pos));
+    cg->pos = offset;
+}
+
+void emit_add(struct bf_codegen* cg, int offset, int value) {
+    int old = cell_value(cg, offset);
+
+    value &= 0xff;
+
+    if (value) {
+        move_to(cg, offset);
+        emit(cg, value <= 128 ? '+' : '-', value <= 128 ? value : 256 - value);
+    }
+
+    cell_write(cg, offset, old < 0 ? -1 : (old + value) & 0xff);
+}
+
+void emit_set(struct bf_codegen* cg, int offset, int value) {
+    int old = cell_value(cg, offset);
+
+    if (old < 0) {
+        move_to(cg, offset);
+        emit(cg, '[', 1);
+        emit(cg, '-', 1);
+        emit(cg, ']', 1);
+        old = 0;
+    }
+
+    emit_add(cg, offset, value - old);
+    cell_write(cg, offset, value & 0xff);
+}
+
+int cell_value(const struct bf_codegen* cg, int offset) {
+    int cell = cg->base + offset;
+
+    if (cg->known_value >= 0 && cg->known == offset) {
+        return cg->known_value;
+    }
+
+    if (cg->fresh && (!cg->touched || cell < cg->touched_min || cell > cg->touched_max)) {
+        return 0;
+    }
+
+    return -1;
+}
+
+void cell_write(struct bf_codegen* cg, int offset, int value) {
+    int cell = cg->base + offset;
+
+    if (cg->fresh) {
+        if (!cg->touched || cell < cg->touched_min) cg->touched_min = cell;
+        if (!cg->touched || cell > cg->touched_max) cg->touched_max = cell;
+        cg->touched = 1;
+    }
+
+    /* A write of an unknown value only matters to the tracked cell. */
+    if (value >= 0 || cg->known == offset) {
+        cg->known = offset;
+        cg->known_value = value;
+    }
+}
@@ -0,0 +1,784 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * C code generator.
+ */
+
+#include "bfoc.h"
+
+#include <stdlib.h>
+
+/**
+ * C code generator state.
+ */
+struct c_codegen {
+    const struct codegen_options* opts;
+    FILE* out;
+    int absolute; /* Cell positions are static, address the tape directly */
+    int mask;     /* Tape index mask for circular tapes, 0 otherwise */
+    int pos;      /* Tape index of the current cell in absolute mode */
+
+    /* Cells held in locals for the loop nest ending at cache_end */
+    int cached[CODEGEN_CACHED_CELLS];
+    int ncached;
+    int cache_end;
+
+    int* sites;   /* Branch site number of each operation, -1 for others */
+    int outline;  /* Move cold top-level loops into functions of their own */
+};
+
+/**
+ * A cell accessed by a loop nest, with its access weight.
+ */
+struct cell_weight {
+    int offset;
+    int weight;
+};
+
+/**
+ * Writes the code for a range of operations. With outlining enabled, cold
+ * loops at the top of the range become calls to their cold_loop function.
+ *
+ * @param cg    Code generator state
+ * @param prog  Program being generated
+ * @param start Index of the first operation
+ * @param end   Index past the last operation
+ */
+static void emit_ops(struct c_codegen* cg, const struct bf_program* prog, int start, int end);
+
+/**
+ * Formats the condition of a loop or if, counting it when the program is
+ * instrumented and hinting its likely outcome from the branch profile.
+ *
+ * @param cg   Code generator state
+ * @param i    Index of the BF_OP_LOOP or BF_OP_IF
+ * @param ref  Condition cell expression
+ * @param buf  Buffer to write the condition to
+ * @param size Buffer size
+ */
+static void branch_condition(const struct c_codegen* cg, int i, const char* ref, char* buf, int size);
+
+/**
+ * Returns the likely outcome of a branch site in the profile: 1 if its
+ * condition is almost always taken, 0 if it almost never is, -1 if the
+ * profile doesn't tell.
+ *
+ * @param cg Code generator state
+ * @param i  Index of the BF_OP_LOOP or BF_OP_IF
+ */
+static int branch_hint(const struct c_codegen* cg, int i);
+
+/**
+ * Returns nonzero if the profile shows the body of a branch site never or
+ * only rarely run, compared to the hottest site.
+ *
+ * @param cg Code generator state
+ * @param i  Index of the BF_OP_LOOP or BF_OP_IF
+ */
+static int branch_cold(const struct c_codegen* cg, int i);
+
+/**
+ * Returns nonzero if cold top-level loops are moved into functions of
+ * their own. That takes a profile, and a tape the functions can reach.
+ * Instrumented programs keep every test in place to count it.
+ *
+ * @param opts Code generation options
+ */
+static int outline_loops(const struct codegen_options* opts);
+
+/**
+ * Numbers the branch sites of a program in order, as the profile does.
+ *
+ * @param prog Program to number
+ * @return     Site number of each operation, -1 for non-branches
+ */
+static int* number_sites(const struct bf_program* prog);
+
+/**
+ * Formats an lvalue expression for the cell at <offset> from the current
+ * pointer position.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset
+ * @param buf    Buffer to write the expression to
+ * @param size   Buffer size
+ */
+static void cell_ref(const struct c_codegen* cg, int offset, char* buf, int size);
+
+/**
+ * Formats an lvalue expression for the tape memory of the cell at <offset>,
+ * bypassing any local the cell is cached in.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset
+ * @param buf    Buffer to write the expression to
+ * @param size   Buffer size
+ */
+static void cell_mem(const struct c_codegen* cg, int offset, char* buf, int size);
+
+/**
+ * Starts caching the most heavily used cells of a loop nest in locals,
+ * when no pointer moves happen in the nest. Cells are loaded before the
+ * loop and stored back after it. The runtime never touches the tape, so
+ * input and output work on the locals as well. Vector updates in the nest
+ * are split into lanes.
+ *
+ * @param cg   Code generator state
+ * @param prog Program being generated
+ * @param loop Index of the outermost BF_OP_LOOP of the nest
+ */
+static void cache_cells(struct c_codegen* cg, const struct bf_program* prog, int loop);
+
+/**
+ * Orders cell weights by decreasing weight.
+ */
+static int compare_weights(const void* a, const void* b);
+
+/**
+ * Formats a tape index expression for the cell at <offset> from the current
+ * pointer position, for use by the heatmap instrumentation.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset
+ * @param buf    Buffer to write the expression to
+ * @param size   Buffer size
+ */
+static void cell_index(const struct c_codegen* cg, int offset, char* buf, int size);
+
+/**
+ * Writes a vector cell update. Lanes are combined with gcc's generic vector
+ * extensions, which wrap per byte and lower to SSE/AVX or SWAR arithmetic
+ * as the target allows. The cells are accessed through memcpy() as they
+ * carry no particular alignment.
+ *
+ * @param cg  Code generator state
+ * @param op  BF_OP_VEC operation
+ * @param vec Lane data
+ */
+static void emit_vec(const struct c_codegen* cg, const struct bf_op* op, const struct bf_vec* vec);
+
+/**
+ * Writes a vector cell update as one scalar update per lane, for when
+ * neighbouring cells may not be contiguous in memory.
+ *
+ * @param cg  Code generator state
+ * @param op  BF_OP_VEC operation
+ * @param vec Lane data
+ */
+static void emit_vec_lanes(const struct c_codegen* cg, const struct bf_op* op, const struct bf_vec* vec);
+
+/**
+ * Returns nonzero if the tape is small enough to be kept local to main(),
+ * where gcc is free to promote the cells to registers.
+ *
+ * @param opts Code generation options
+ */
+static int register_tape(const struct codegen_options* opts);
+
+/**
+ * Writes the types and external functions generated code uses.
+ *
+ * @param opts Code generation options
+ * @param out  File to write generated code to
+ */
+static void emit_declarations(const struct codegen_options* opts, FILE* out);
+
+void generate_c_prologue(const struct bf_program* prog, const struct codegen_options* opts, FILE* out) {
+    int tape_length = opts->tape_length;
+    int origin = 0, sites = bf_profile_sites(prog);
+
+    if (opts->extent_known) {
+        tape_length = opts->extent_max - opts->extent_min + 1;
+        origin = -opts->extent_min;
+    }
+
+    emit_declarations(opts, out);
+
+    if (!opts->extent_known && opts->wrap) {
+        fprintf(out, "static uint8_t tape[%d];\nstatic size_t p;\n\n", tape_length);
+    } else if (!opts->extent_known) {
+        fprintf(out, "static uint8_t tape[%d], *ptr = tape;\n\n", tape_length);
+    } else if (!register_tape(opts)) {
+        fprintf(out, "static uint8_t tape[%d];\n\n", tape_length);
+    }
+
+    if (opts->heatmap_path) {
+        /*
+         * Tape heatmap instrumentation. Every cell access bumps a per-cell
+         * read or write counter and widens the observed extent. Accesses
+         * at an offset from the pointer count as much as the cell under
+         * it. The runtime writes the heatmap out at exit.
+         */
+        fprintf(out, "static uint64_t heat_reads[%d], heat_writes[%d];\n", tape_length, tape_length);
+        fprintf(out, "static long heat_min = %d, heat_max = %d;\n\n", origin, origin);
+        fprintf(out, "#define HEAT_SEEN(i)  ((i) < heat_min ? (heat_min = (i)) : 0, (i) > heat_max ? (heat_max = (i)) : 0)\n");
+        fprintf(out, "#define HEAT_READ(i)  (HEAT_SEEN(i), ++heat_reads[i])\n");
+        fprintf(out, "#define HEAT_WRITE(i) (HEAT_SEEN(i), ++heat_writes[i])\n\n");
+    }
+
+    /* Step budget, charged at loop back edges. */
+    if (opts->step_limit) {
+        fprintf(out, "static long steps = %ld;\n\n", opts->step_limit);
+    }
+
+    if (opts->profile_path) {
+        /* Branch profile instrumentation. Every loop and if condition
+         * counts its tests and how many were taken. */
+        fprintf(out, "static uint64_t prof[%d][2];\n\n", sites ? sites : 1);
+        fprintf(out, "#define PROF(s, c) (++prof[s][0], (c) ? (++prof[s][1], 1) : 0)\n\n");
+    }
+
+    /*
+     * Cold top-level loops are moved out of main() into cold functions,
+     * which gcc places apart from the hot code. Loops at the top level
+     * leave the pointer where they found it whenever positions are static.
+     */
+    if (outline_loops(opts)) {
+        struct c_codegen cg = {
+            .opts     = opts,
+            .out      = out,
+            .absolute = opts->extent_known,
+            .mask     = opts->wrap ? opts->tape_length - 1 : 0,
+            .pos      = opts->extent_known ? -opts->extent_min : 0,
+            .sites    = number_sites(prog),
+        };
+
+        for (int i = 0; i < prog->len; ++i) {
+            const struct bf_op* op = &prog->ops[i];
+
+            if (op->type == BF_OP_MOVE) {
+                cg.pos += op->arg;
+            } else if (op->type == BF_OP_LOOP && branch_cold(&cg, i)) {
+                fprintf(out, "static __attribute__((cold, noinline)) void cold_loop%d(void) {\n", i);
+                emit_ops(&cg, prog, i, op->match + 1);
+                fprintf(out, "}\n\n");
+                i = op->match;
+            } else if (op->type == BF_OP_LOOP || op->type == BF_OP_IF) {
+                i = op->match;
+            }
+        }
+
+        free(cg.sites);
+    }
+
+    fprintf(out, "int main() {\n");
+
+    if (opts->extent_known && register_tape(opts)) {
+        fprintf(out, "\tuint8_t tape[%d] = { 0 };\n", tape_length);
+    }
+
+    if (opts->heatmap_path) {
+        fprintf(out, "\tbfrt_heatmap(");
+        write_c_string(opts->heatmap_path, out);
+        fprintf(out, ", heat_reads, heat_writes, &heat_min, &heat_max, %d);\n", origin);
+    }
+
+    if (opts->profile_path) {
+        fprintf(out, "\tbfrt_profile(");
+        write_c_string(opts->profile_path, out);
+        fprintf(out, ", prof, %d);\n", sites);
+    }
+
+    if (opts->prefault) {
+        fprintf(out, "\tbfrt_prefault_output(%d);\n", opts->lock);
+
+        /* A local tape is left alone, taking its address would keep it out
+         * of registers. */
+        if (!opts->extent_known || !register_tape(opts)) {
+            fprintf(out, "\tbfrt_prefault(tape, sizeof tape, %d);\n", opts->lock);
+        }
+    }
+}
+
+int generate_c_source(const struct bf_program* prog, const struct codegen_options* opts, FILE* out) {
+    struct c_codegen cg = {
+        .opts     = opts,
+        .out      = out,
+        .absolute = opts->extent_known,
+        .mask     = opts->wrap ? opts->tape_length - 1 : 0,
+        .pos      = opts->extent_known ? -opts->extent_min : 0,
+        .sites    = number_sites(prog),
+        .outline  = outline_loops(opts),
+    };
+
+    emit_ops(&cg, prog, 0, prog->len);
+    free(cg.sites);
+
+    return 0;
+}
+
+void generate_c_epilogue(const struct codegen_options* opts, FILE* out) {
+    fprintf(out, "\treturn 0;\n}\n\n");
+}
+
+int generate_c_region(const struct bf_program* region, const struct codegen_options* opts, const char* name, FILE* out) {
+    struct c_codegen cg = {
+        .opts  = opts,
+        .out   = out,
+        .mask  = opts->wrap ? opts->tape_length - 1 : 0,
+        .sites = number_sites(region),
+    };
+
+    emit_declarations(opts, out);
+
+    /* The pointer is kept in a local while the region runs. */
+    fprintf(out, "extern uint8_t tape[];\n");
+
+    if (opts->step_limit) {
+        fprintf(out, "extern long steps;\n");
+    }
+
+    if (opts->wrap) {
+        fprintf(out, "extern size_t tape_p;\n\nvoid %s(void) {\n\tsize_t p = tape_p;\n", name);
+    } else {
+        fprintf(out, "extern uint8_t* tape_ptr;\n\nvoid %s(void) {\n\tuint8_t* ptr = tape_ptr;\n", name);
+    }
+
+    emit_ops(&cg, region, 0, region->len);
+    free(cg.sites);
+
+    fprintf(out, opts->wrap ? "\ttape_p = p;\n}\n" : "\ttape_ptr = ptr;\n}\n");
+    return 0;
+}
+
+void generate_c_region_main(const struct codegen_options* opts, const char* const* names, int count, FILE* out) {
+    emit_declarations(opts, out);
+
+    fprintf(out, "uint8_t tape[%d];\n", opts->tape_length);
+    fprintf(out, opts->wrap ? "size_t tape_p;\n" : "uint8_t* tape_ptr = tape;\n");
+
+    if (opts->step_limit) {
+        fprintf(out, "long steps = %ld;\n", opts->step_limit);
+    }
+
+    fprintf(out, "\n");
+
+    for (int i = 0; i < count; ++i) {
+        fprintf(out, "void %s(void);\n", names[i]);
+    }
+
+    fprintf(out, "\nint main() {\n");
+
+    if (opts->prefault) {
+        fprintf(out, "\tbfrt_prefault_output(%d);\n", opts->lock);
+        fprintf(out, "\tbfrt_prefault(tape, sizeof tape, %d);\n", opts->lock);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        fprintf(out, "\t%s();\n", names[i]);
+    }
+
+    fprintf(out, "\treturn 0;\n}\n");
+}
+
+void emit_declarations(const struct codegen_options* opts, FILE* out) {
+    /*
+     * The generated program includes no system headers. Types come from
+     * gcc's builtin macros and the few libc and runtime library functions
+     * used are declared directly, matching runtime/bfocrt.h. Both runtimes
+     * provide putchar() and getchar().
+     */
+    fprintf(out, "typedef __UINT8_TYPE__ uint8_t;\n");
+    fprintf(out, "typedef __UINT64_TYPE__ uint64_t;\n");
+    fprintf(out, "typedef __SIZE_TYPE__ size_t;\n");
+
+    for (int lanes = 4; lanes <= BF_VEC_MAX_LANES; lanes *= 2) {
+        fprintf(out, "typedef uint8_t v%du8 __attribute__((vector_size(%d)));\n", lanes, lanes);
+    }
+
+    fprintf(out, "\n");
+    fprintf(out, "int putchar(int c);\n");
+    fprintf(out, "int getchar(void);\n");
+
+    if (opts->heatmap_path) {
+        fprintf(out, "void bfrt_heatmap(const char* path, const uint64_t* reads, const uint64_t* writes, const long* min, const long* max, long origin);\n");
+    }
+
+    if (opts->profile_path) {
+        fprintf(out, "void bfrt_profile(const char* path, const uint64_t (*counts)[2], long sites);\n");
+    }
+
+    if (opts->step_limit) {
+        fprintf(out, "__attribute__((noreturn)) void bfrt_out_of_steps(void);\n");
+    }
+
+    if (opts->prefault) {
+        fprintf(out, "void bfrt_prefault(volatile void* mem, size_t len, int lock);\n");
+        fprintf(out, "void bfrt_prefault_output(int lock);\n");
+    }
+
+    fprintf(out, "\n");
+}
+
+void emit_ops(struct c_codegen* cg, const struct bf_program* prog, int start, int end) {
+    const struct codegen_options* opts = cg->opts;
+    FILE* out = cg->out;
+    char ref[32], index[32], src[32], cond[128];
+    int depth = 0;
+
+    for (int i = start; i < end; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+
+        cell_ref(cg, op->offset, ref, sizeof ref);
+        cell_index(cg, op->offset, index, sizeof index);
+
+        switch (op->type) {
+        case BF_OP_ADD:
+            fprintf(out, "\t%s %c= %d;\n", ref, op->arg < 0 ? '-' : '+', abs(op->arg));
+            if (opts->heatmap_path) fprintf(out, "\tHEAT_WRITE(%s);\n", index);
+            break;
+        case BF_OP_SET:
+            fprintf(out, "\t%s = %d;\n", ref, op->arg);
+            if (opts->heatmap_path) fprintf(out, "\tHEAT_WRITE(%s);\n", index);
+            break;
+        case BF_OP_MOVE:
+            /* Pointer moves vanish entirely when positions are static. */
+            if (cg->absolute) {
+                cg->pos += op->arg;
+            } else if (cg->mask) {
+                fprintf(out, "\tp = (p %c %d) & %d;\n", op->arg < 0 ? '-' : '+', abs(op->arg), cg->mask);
+            } else {
+                fprintf(out, "\tptr %c= %d;\n", op->arg < 0 ? '-' : '+', abs(op->arg));
+            }
+            break;
+        case BF_OP_OUTPUT:
+            if (opts->heatmap_path) fprintf(out, "\tHEAT_READ(%s);\n", index);
+            fprintf(out, "\tputchar(%s);\n", ref);
+            break;
+        case BF_OP_INPUT:
+            fprintf(out, "\t%s = getchar();\n", ref);
+            if (opts->heatmap_path) fprintf(out, "\tHEAT_WRITE(%s);\n", index);
+            break;
+        case BF_OP_LOOP:
+            if (cg->outline && !depth && branch_cold(cg, i)) {
+                fprintf(out, "\tif (__builtin_expect(!!(%s), 0)) cold_loop%d();\n", ref, i);
+                i = op->match;
+                break;
+            }
+
+            if (!cg->ncached && !opts->no_cell_cache) {
+                cache_cells(cg, prog, i);
+                cell_ref(cg, op->offset, ref, sizeof ref);
+            }
+
+            /* New loop point. The condition is a read on every test. */
+            branch_condition(cg, i, ref, cond, sizeof cond);
+            fprintf(out, "loop%d:\n", i);
+            if (opts->heatmap_path) fprintf(out, "\tHEAT_READ(%s);\n", index);
+            fprintf(out, "\tif (%s) {\n", cond);
+            if (branch_cold(cg, i)) fprintf(out, "\tcold%d: __attribute__((cold, unused));\n", i);
+            ++depth;
+            break;
+        case BF_OP_END:
+            if (opts->step_limit) {
+                fprintf(out, "\tif (__builtin_expect((steps -= %d) < 0, 0)) bfrt_out_of_steps();\n", bf_loop_cost(prog, op->match));
+            }
+
+            fprintf(out, "\tgoto loop%d; }\n", op->match);
+            --depth;
+
+            /* Spill the cached cells once the nest is done. */
+            if (cg->ncached && i == cg->cache_end) {
+                for (int c = 0; c < cg->ncached; ++c) {
+                    cell_mem(cg, cg->cached[c], ref, sizeof ref);
+                    fprintf(out, "\t%s = c%d;\n", ref, c);
+                }
+
+                fprintf(out, "\t}\n");
+                cg->ncached = 0;
+            }
+            break;
+        case BF_OP_MUL:
+            cell_ref(cg, op->src, src, sizeof src);
+
+            if (op->arg == 1 || op->arg == -1) {
+                fprintf(out, "\t%s %c= %s;\n", ref, op->arg < 0 ? '-' : '+', src);
+            } else {
+                fprintf(out, "\t%s += %s * %d;\n", ref, src, op->arg);
+            }
+
+            if (opts->heatmap_path) {
+                cell_index(cg, op->src, src, sizeof src);
+                fprintf(out, "\tHEAT_READ(%s);\n\tHEAT_WRITE(%s);\n", src, index);
+            }
+            break;
+        case BF_OP_IF:
+            branch_condition(cg, i, ref, cond, sizeof cond);
+            if (opts->heatmap_path) fprintf(out, "\tHEAT_READ(%s);\n", index);
+            fprintf(out, "\tif (%s) {\n", cond);
+            if (branch_cold(cg, i)) fprintf(out, "\tcold%d: __attribute__((cold, unused));\n", i);
+            ++depth;
+            break;
+        case BF_OP_ENDIF:
+            fprintf(out, "\t}\n");
+            --depth;
+            break;
+        case BF_OP_VEC:
+            /* A circular tape can wrap in the middle of the vector, and
+             * cached lanes live in separate locals. */
+            if ((cg->mask && !cg->absolute) || cg->ncached) {
+                emit_vec_lanes(cg, op, &prog->vecs[op->match]);
+            } else {
+                emit_vec(cg, op, &prog->vecs[op->match]);
+            }
+            break;
+        }
+    }
+}
+
+void write_c_string(const char* str, FILE* out) {
+    fputc('"', out);
+
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(out, "\\%c", *str);
+        } else if (*str < ' ' || *str > '~') {
+            fprintf(out, "\\%03o", (unsigned char) *str);
+        } else {
+            fputc(*str, out);
+        }
+    }
+
+    fputc('"', out);
+}
+
+void branch_condition(const struct c_codegen* cg, int i, const char* ref, char* buf, int size) {
+    char test[64];
+    int hint = branch_hint(cg, i);
+
+    if (cg->opts->profile_path) {
+        snprintf(test, sizeof test, "PROF(%d, %s)", cg->sites[i], ref);
+    } else {
+        snprintf(test, sizeof test, "%s", ref);
+    }
+
+    if (hint < 0) {
+        snprintf(buf, size, "%s", test);
+    } else {
+        snprintf(buf, size, "__builtin_expect(!!(%s), %d)", test, hint);
+    }
+}
+
+int branch_hint(const struct c_codegen* cg, int i) {
+    if (!cg->opts->profile) {
+        return -1;
+    }
+
+    const struct bf_profile_site* site = &cg->opts->profile->sites[cg->sites[i]];
+
+    /* Only strongly biased branches are worth a hint. */
+    if (site->taken * 8 >= site->tests * 7 && site->tests) {
+        return 1;
+    } else if (site->taken * 8 <= site->tests) {
+        return 0;
+    }
+
+    return -1;
+}
+
+int branch_cold(const struct c_codegen* cg, int i) {
+    if (!cg->opts->profile) {
+        return 0;
+    }
+
+    const struct bf_profile_site* site = &cg->opts->profile->sites[cg->sites[i]];
+
+    return !site->taken || site->taken * BF_PROFILE_COLD_RATIO < cg->opts->profile->peak;
+}
+
+int outline_loops(const struct codegen_options* opts) {
+    return opts->profile && !opts->profile_path && !(opts->extent_known && register_tape(opts));
+}
+
+int* number_sites(const struct bf_program* prog) {
+    int* sites = malloc(sizeof(int) * (prog->len + 1));
+
+    for (int i = 0, site = 0; i < prog->len; ++i) {
+        sites[i] = prog->ops[i].type == BF_OP_LOOP || prog->ops[i].type == BF_OP_IF ? site++ : -1;
+    }
+
+    return sites;
+}
+
+void cell_ref(const struct c_codegen* cg, int offset, char* buf, int size) {
+    for (int c = 0; c < cg->ncached; ++c) {
+        if (cg->cached[c] == offset) {
+            snprintf(buf, size, "c%d", c);
+            return;
+        }
+    }
+
+    cell_mem(cg, offset, buf, size);
+}
+
+void cell_mem(const struct c_codegen* cg, int offset, char* buf, int size) {
+    /* A circular tape index is always kept masked, so the mask folds away
+     * for the current cell. */
+    if (cg->absolute) {
+        snprintf(buf, size, "tape[%d]", cg->pos + offset);
+    } else if (cg->mask && offset) {
+        snprintf(buf, size, "tape[(p %c %d) & %d]", offset < 0 ? '-' : '+', abs(offset), cg->mask);
+    } else if (cg->mask) {
+        snprintf(buf, size, "tape[p]");
+    } else if (offset) {
+        snprintf(buf, size, "ptr[%d]", offset);
+    } else {
+        snprintf(buf, size, "*ptr");
+    }
+}
+
+void cell_index(const struct c_codegen* cg, int offset, char* buf, int size) {
+    if (cg->absolute) {
+        snprintf(buf, size, "%d", cg->pos + offset);
+    } else if (cg->mask) {
+        snprintf(buf, size, "((p + %d) & %d)", offset, cg->mask);
+    } else {
+        snprintf(buf, size, "ptr - tape + %d", offset);
+    }
+}
+
+void emit_vec(const struct c_codegen* cg, const struct bf_op* op, const struct bf_vec* vec) {
+    char ref[32], index[32];
+    int adds = 0, sets = 0;
+
+    for (int i = 0; i < op->arg; ++i) {
+        if (vec->mask[i]) ++adds; else ++sets;
+    }
+
+    cell_ref(cg, op->offset, ref, sizeof ref);
+    fprintf(cg->out, "\t{ v%du8 v", op->arg);
+
+    /* All-set vectors don't need the old cells. */
+    if (adds) {
+        fprintf(cg->out, "; __builtin_memcpy(&v, &%s, %d); v = ", ref, op->arg);
+
+        if (sets) {
+            fprintf(cg->out, "(v & (v%du8){ ", op->arg);
+
+            for (int i = 0; i < op->arg; ++i) {
+                fprintf(cg->out, "%s%d", i ? ", " : "", vec->mask[i]);
+            }
+
+            fprintf(cg->out, " })");
+        } else {
+            fprintf(cg->out, "v");
+        }
+
+        fprintf(cg->out, " + ");
+    } else {
+        fprintf(cg->out, " = ");
+    }
+
+    fprintf(cg->out, "(v%du8){ ", op->arg);
+
+    for (int i = 0; i < op->arg; ++i) {
+        fprintf(cg->out, "%s%d", i ? ", " : "", vec->add[i]);
+    }
+
+    fprintf(cg->out, " }; __builtin_memcpy(&%s, &v, %d); }\n", ref, op->arg);
+
+    if (cg->opts->heatmap_path) {
+        for (int i = 0; i < op->arg; ++i) {
+            if (vec->mask[i] != 0xff || vec->add[i]) {
+                cell_index(cg, op->offset + i, index, sizeof index);
+                fprintf(cg->out, "\tHEAT_WRITE(%s);\n", index);
+            }
+        }
+    }
+}
+
+void emit_vec_lanes(const struct c_codegen* cg, const struct bf_op* op, const struct bf_vec* vec) {
+    char ref[32], index[32];
+
+    for (int i = 0; i < op->arg; ++i) {
+        if (vec->mask[i] == 0xff && !vec->add[i]) {
+            continue;
+        }
+
+        cell_ref(cg, op->offset + i, ref, sizeof ref);
+
+        if (vec->mask[i]) {
+            fprintf(cg->out, "\t%s += %d;\n", ref, vec->add[i]);
+        } else {
+            fprintf(cg->out, "\t%s = %d;\n", ref, vec->add[i]);
+        }
+
+        if (cg->opts->heatmap_path) {
+            cell_index(cg, op->offset + i, index, sizeof index);
+            fprintf(cg->out, "\tHEAT_WRITE(%s);\n", index);
+        }
+    }
+}
+
+void cache_cells(struct c_codegen* cg, const struct bf_program* prog, int loop) {
+    int end = prog->ops[loop].match, ncells = 0, depth = 0;
+    struct cell_weight* cells = malloc(sizeof(struct cell_weight) * ((end - loop) * BF_VEC_MAX_LANES + 1));
+    char ref[32];
+
+    for (int i = loop; i < end; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+        int offsets[BF_VEC_MAX_LANES], n = 0;
+
+        switch (op->type) {
+        case BF_OP_MOVE:
+            free(cells);
+            return;
+        case BF_OP_END:
+        case BF_OP_ENDIF:
+            --depth;
+            continue;
+        case BF_OP_MUL:
+            offsets[n++] = op->src;
+            offsets[n++] = op->offset;
+            break;
+        case BF_OP_VEC:
+            for (int lane = 0; lane < op->arg; ++lane) {
+                if (prog->vecs[op->match].mask[lane] != 0xff || prog->vecs[op->match].add[lane]) {
+                    offsets[n++] = op->offset + lane;
+                }
+            }
+            break;
+        default:
+            offsets[n++] = op->offset;
+            break;
+        }
+
+        /* Accesses in inner loops weigh more, they likely run more often. */
+        for (int k = 0; k < n; ++k) {
+            int c = 0;
+
+            while (c < ncells && cells[c].offset != offsets[k]) ++c;
+
+            if (c == ncells) {
+                cells[ncells++] = (struct cell_weight) { offsets[k], 0 };
+            }
+
+            cells[c].weight += 1 << (2 * (depth < 8 ? depth : 8));
+        }
+
+        if (op->type == BF_OP_LOOP || op->type == BF_OP_IF) ++depth;
+    }
+
+    qsort(cells, ncells, sizeof(struct cell_weight), compare_weights);
+
+    for (int c = 0; c < ncells && c < CODEGEN_CACHED_CELLS; ++c) {
+        cell_mem(cg, cells[c].offset, ref, sizeof ref);
+        fprintf(cg->out, "\t%suint8_t c%d = %s;\n", c ? "" : "{ ", c, ref);
+        cg->cached[cg->ncached++] = cells[c].offset;
+    }
+
+    cg->cache_end = end;
+    free(cells);
+}
+
+int compare_weights(const void* a, const void* b) {
+    const struct cell_weight* x = a;
+    const struct cell_weight* y = b;
+
+    return x->weight > y->weight ? -1 : x->weight < y->weight;
+}
+
+int register_tape(const struct codegen_options* opts) {
+    return opts->extent_max - opts->extent_min + 1 <= CODEGEN_REGISTER_TAPE_LENGTH;
+}
@@ -0,0 +1,300 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * libgccjit code generator. Builds the program through the libgccjit API
+ * and compiles it to an executable in-process, without generating source
+ * text or starting a compiler. Only built with GCCJIT=1, as most systems
+ * don't have libgccjit installed.
+ */
+
+#include "bfoc.h"
+
+#ifdef BFOC_GCCJIT
+
+#include <stdlib.h>
+
+#include <libgccjit.h>
+
+/**
+ * libgccjit code generator state.
+ */
+struct jit_codegen {
+    gcc_jit_context* ctxt;
+    gcc_jit_function* func;
+    gcc_jit_block* block;  /* Block currently being filled */
+    gcc_jit_type* byte_type;
+    gcc_jit_type* int_type;
+    gcc_jit_type* long_type;
+    gcc_jit_lvalue* tape;
+    gcc_jit_lvalue* p;     /* Tape index of the current cell, NULL in absolute mode */
+    gcc_jit_lvalue* steps; /* Remaining step budget, NULL without a step limit */
+    int absolute;          /* Cell positions are static, address the tape directly */
+    int mask;              /* Tape index mask for circular tapes, 0 otherwise */
+    int pos;               /* Tape index of the current cell in absolute mode */
+};
+
+/**
+ * Returns an lvalue for the cell at <offset> from the current position.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset
+ */
+static gcc_jit_lvalue* cell(struct jit_codegen* cg, int offset);
+
+/**
+ * Returns a constant of the given type.
+ *
+ * @param cg    Code generator state
+ * @param type  Constant type
+ * @param value Constant value
+ */
+static gcc_jit_rvalue* constant(struct jit_codegen* cg, gcc_jit_type* type, int value);
+
+/**
+ * Returns a test of the cell at <offset> against zero.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset
+ */
+static gcc_jit_rvalue* cell_nonzero(struct jit_codegen* cg, int offset);
+
+int generate_gccjit_binary(const struct bf_program* prog, const struct codegen_options* opts, const char* runtime_dir, const char* output) {
+    char runtime_flag[4096];
+    int length = opts->tape_length, status = 0;
+
+    struct jit_codegen cg = {
+        .ctxt     = gcc_jit_context_acquire(),
+        .absolute = opts->extent_known,
+        .mask     = opts->wrap ? opts->tape_length - 1 : 0,
+        .pos      = opts->extent_known ? -opts->extent_min : 0,
+    };
+
+    if (!cg.ctxt) {
+        fprintf(stderr, "error: couldn't create a libgccjit context\n");
+        return -1;
+    }
+
+    if (opts->extent_known) {
+        length = opts->extent_max - opts->extent_min + 1;
+    }
+
+    gcc_jit_context_set_int_option(cg.ctxt, GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL, opts->opt_level);
+
+    if (opts->native) {
+        gcc_jit_context_add_command_line_option(cg.ctxt, "-march=native");
+    }
+
+    snprintf(runtime_flag, sizeof runtime_flag, "-L%s", runtime_dir);
+    gcc_jit_context_add_driver_option(cg.ctxt, runtime_flag);
+
+    if (opts->runtime == RUNTIME_NOSTDLIB) {
+        gcc_jit_context_add_driver_option(cg.ctxt, "-static");
+        gcc_jit_context_add_driver_option(cg.ctxt, "-nostdlib");
+        gcc_jit_context_add_driver_option(cg.ctxt, "-lbfocrt-nostdlib");
+        gcc_jit_context_add_driver_option(cg.ctxt, "-lgcc");
+    } else if (opts->runtime == RUNTIME_REPLAY) {
+        gcc_jit_context_add_driver_option(cg.ctxt, "-lbfocrt-replay");
+        gcc_jit_context_add_driver_option(cg.ctxt, "-lbfocrt");
+    } else {
+        gcc_jit_context_add_driver_option(cg.ctxt, "-lbfocrt");
+    }
+
+    cg.byte_type = gcc_jit_context_get_type(cg.ctxt, GCC_JIT_TYPE_UNSIGNED_CHAR);
+    cg.int_type = gcc_jit_context_get_type(cg.ctxt, GCC_JIT_TYPE_INT);
+    cg.long_type = gcc_jit_context_get_type(cg.ctxt, GCC_JIT_TYPE_LONG);
+
+    /* Runtime functions */
+    gcc_jit_param* putchar_params[] = {
+        gcc_jit_context_new_param(cg.ctxt, NULL, cg.int_type, "c"),
+    };
+    gcc_jit_param* prefault_params[] = {
+        gcc_jit_context_new_param(cg.ctxt, NULL, gcc_jit_context_get_type(cg.ctxt, GCC_JIT_TYPE_VOID_PTR), "mem"),
+        gcc_jit_context_new_param(cg.ctxt, NULL, gcc_jit_context_get_type(cg.ctxt, GCC_JIT_TYPE_SIZE_T), "len"),
+        gcc_jit_context_new_param(cg.ctxt, NULL, cg.int_type, "lock"),
+    };
+    gcc_jit_param* prefault_output_params[] = {
+        gcc_jit_context_new_param(cg.ctxt, NULL, cg.int_type, "lock"),
+    };
+
+    gcc_jit_type* void_type = gcc_jit_context_get_type(cg.ctxt, GCC_JIT_TYPE_VOID);
+    gcc_jit_function* func_putchar = gcc_jit_context_new_function(cg.ctxt, NULL, GCC_JIT_FUNCTION_IMPORTED, cg.int_type, "putchar", 1, putchar_params, 0);
+    gcc_jit_function* func_getchar = gcc_jit_context_new_function(cg.ctxt, NULL, GCC_JIT_FUNCTION_IMPORTED, cg.int_type, "getchar", 0, NULL, 0);
+    gcc_jit_function* func_prefault = gcc_jit_context_new_function(cg.ctxt, NULL, GCC_JIT_FUNCTION_IMPORTED, void_type, "bfrt_prefault", 3, prefault_params, 0);
+    gcc_jit_function* func_prefault_output = gcc_jit_context_new_function(cg.ctxt, NULL, GCC_JIT_FUNCTION_IMPORTED, void_type, "bfrt_prefault_output", 1, prefault_output_params, 0);
+    gcc_jit_function* func_out_of_steps = gcc_jit_context_new_function(cg.ctxt, NULL, GCC_JIT_FUNCTION_IMPORTED, void_type, "bfrt_out_of_steps", 0, NULL, 0);
+
+    /* Tape, index and main() */
+    gcc_jit_type* tape_type = gcc_jit_context_new_array_type(cg.ctxt, NULL, cg.byte_type, length);
+
+    cg.tape = gcc_jit_context_new_global(cg.ctxt, NULL, GCC_JIT_GLOBAL_INTERNAL, tape_type, "tape");
+    cg.func = gcc_jit_context_new_function(cg.ctxt, NULL, GCC_JIT_FUNCTION_EXPORTED, cg.int_type, "main", 0, NULL, 0);
+    cg.block = gcc_jit_function_new_block(cg.func, "entry");
+
+    if (!cg.absolute) {
+        cg.p = gcc_jit_function_new_local(cg.func, NULL, cg.long_type, "p");
+        gcc_jit_block_add_assignment(cg.block, NULL, cg.p, constant(&cg, cg.long_type, 0));
+    }
+
+    /* Step budget, charged at loop back edges. */
+    if (opts->step_limit) {
+        cg.steps = gcc_jit_function_new_local(cg.func, NULL, cg.long_type, "steps");
+        gcc_jit_block_add_assignment(cg.block, NULL, cg.steps, gcc_jit_context_new_rvalue_from_long(cg.ctxt, cg.long_type, opts->step_limit));
+    }
+
+    if (opts->prefault) {
+        gcc_jit_rvalue* args[] = {
+            gcc_jit_lvalue_get_address(gcc_jit_context_new_array_access(cg.ctxt, NULL, gcc_jit_lvalue_as_rvalue(cg.tape), constant(&cg, cg.int_type, 0)), NULL),
+            gcc_jit_context_new_rvalue_from_long(cg.ctxt, gcc_jit_context_get_type(cg.ctxt, GCC_JIT_TYPE_SIZE_T), length),
+            constant(&cg, cg.int_type, opts->lock),
+        };
+
+        gcc_jit_block_add_eval(cg.block, NULL, gcc_jit_context_new_call(cg.ctxt, NULL, func_prefault_output, 1, &args[2]));
+        gcc_jit_block_add_eval(cg.block, NULL, gcc_jit_context_new_call(cg.ctxt, NULL, func_prefault, 3, args));
+    }
+
+    /* Loop and if blocks, indexed by the opening operation. */
+    gcc_jit_block** heads = calloc(prog->len, sizeof *heads);
+    gcc_jit_block** exits = calloc(prog->len, sizeof *exits);
+
+    for (int i = 0; i < prog->len; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+        gcc_jit_block* body;
+        gcc_jit_rvalue* value;
+
+        switch (op->type) {
+        case BF_OP_ADD:
+            gcc_jit_block_add_assignment_op(cg.block, NULL, cell(&cg, op->offset), GCC_JIT_BINARY_OP_PLUS, constant(&cg, cg.byte_type, op->arg & 0xff));
+            break;
+        case BF_OP_SET:
+            gcc_jit_block_add_assignment(cg.block, NULL, cell(&cg, op->offset), constant(&cg, cg.byte_type, op->arg & 0xff));
+            break;
+        case BF_OP_MOVE:
+            if (cg.absolute) {
+                cg.pos += op->arg;
+            } else if (cg.mask) {
+                value = gcc_jit_context_new_binary_op(cg.ctxt, NULL, GCC_JIT_BINARY_OP_PLUS, cg.long_type, gcc_jit_lvalue_as_rvalue(cg.p), constant(&cg, cg.long_type, op->arg));
+                value = gcc_jit_context_new_binary_op(cg.ctxt, NULL, GCC_JIT_BINARY_OP_BITWISE_AND, cg.long_type, value, constant(&cg, cg.long_type, cg.mask));
+                gcc_jit_block_add_assignment(cg.block, NULL, cg.p, value);
+            } else {
+                gcc_jit_block_add_assignment_op(cg.block, NULL, cg.p, GCC_JIT_BINARY_OP_PLUS, constant(&cg, cg.long_type, op->arg));
+            }
+            break;
+        case BF_OP_OUTPUT:
+            value = gcc_jit_context_new_cast(cg.ctxt, NULL, gcc_jit_lvalue_as_rvalue(cell(&cg, op->offset)), cg.int_type);
+            gcc_jit_block_add_eval(cg.block, NULL, gcc_jit_context_new_call(cg.ctxt, NULL, func_putchar, 1, &value));
+            break;
+        case BF_OP_INPUT:
+            value = gcc_jit_context_new_call(cg.ctxt, NULL, func_getchar, 0, NULL);
+            gcc_jit_block_add_assignment(cg.block, NULL, cell(&cg, op->offset), gcc_jit_context_new_cast(cg.ctxt, NULL, value, cg.byte_type));
+            break;
+        case BF_OP_LOOP:
+            heads[i] = gcc_jit_function_new_block(cg.func, NULL);
+            exits[i] = gcc_jit_function_new_block(cg.func, NULL);
+            body = gcc_jit_function_new_block(cg.func, NULL);
+
+            gcc_jit_block_end_with_jump(cg.block, NULL, heads[i]);
+            gcc_jit_block_end_with_conditional(heads[i], NULL, cell_nonzero(&cg, op->offset), body, exits[i]);
+            cg.block = body;
+            break;
+        case BF_OP_END:
+            if (cg.steps) {
+                gcc_jit_block* exhausted = gcc_jit_function_new_block(cg.func, NULL);
+                gcc_jit_block* latch = gcc_jit_function_new_block(cg.func, NULL);
+
+                gcc_jit_block_add_assignment_op(cg.block, NULL, cg.steps, GCC_JIT_BINARY_OP_MINUS, constant(&cg, cg.long_type, bf_loop_cost(prog, op->match)));
+                value = gcc_jit_context_new_comparison(cg.ctxt, NULL, GCC_JIT_COMPARISON_LT, gcc_jit_lvalue_as_rvalue(cg.steps), constant(&cg, cg.long_type, 0));
+                gcc_jit_block_end_with_conditional(cg.block, NULL, value, exhausted, latch);
+
+                gcc_jit_block_add_eval(exhausted, NULL, gcc_jit_context_new_call(cg.ctxt, NULL, func_out_of_steps, 0, NULL));
+                gcc_jit_block_end_with_return(exhausted, NULL, constant(&cg, cg.int_type, 0));
+                cg.block = latch;
+            }
+
+            gcc_jit_block_end_with_jump(cg.block, NULL, heads[op->match]);
+            cg.block = exits[op->match];
+            break;
+        case BF_OP_MUL:
+            value = gcc_jit_context_new_binary_op(cg.ctxt, NULL, GCC_JIT_BINARY_OP_MULT, cg.byte_type, gcc_jit_lvalue_as_rvalue(cell(&cg, op->src)), constant(&cg, cg.byte_type, op->arg & 0xff));
+            gcc_jit_block_add_assignment_op(cg.block, NULL, cell(&cg, op->offset), GCC_JIT_BINARY_OP_PLUS, value);
+            break;
+        case BF_OP_IF:
+            exits[i] = gcc_jit_function_new_block(cg.func, NULL);
+            body = gcc_jit_function_new_block(cg.func, NULL);
+
+            gcc_jit_block_end_with_conditional(cg.block, NULL, cell_nonzero(&cg, op->offset), body, exits[i]);
+            cg.block = body;
+            break;
+        case BF_OP_ENDIF:
+            gcc_jit_block_end_with_jump(cg.block, NULL, exits[op->match]);
+            cg.block = exits[op->match];
+            break;
+        case BF_OP_VEC:
+            /* Lanes are built as scalar updates. gcc's SLP vectorizer
+             * merges adjacent byte updates back into vector operations. */
+            for (int lane = 0; lane < op->arg; ++lane) {
+                const struct bf_vec* vec = &prog->vecs[op->match];
+
+                if (!vec->mask[lane]) {
+                    gcc_jit_block_add_assignment(cg.block, NULL, cell(&cg, op->offset + lane), constant(&cg, cg.byte_type, vec->add[lane]));
+                } else if (vec->add[lane]) {
+                    gcc_jit_block_add_assignment_op(cg.block, NULL, cell(&cg, op->offset + lane), GCC_JIT_BINARY_OP_PLUS, constant(&cg, cg.byte_type, vec->add[lane]));
+                }
+            }
+            break;
+        }
+    }
+
+    gcc_jit_block_end_with_return(cg.block, NULL, constant(&cg, cg.int_type, 0));
+
+    gcc_jit_context_compile_to_file(cg.ctxt, GCC_JIT_OUTPUT_KIND_EXECUTABLE, output);
+
+    if (gcc_jit_context_get_first_error(cg.ctxt)) {
+        fprintf(stderr, "error: libgccjit: %s\n", gcc_jit_context_get_first_error(cg.ctxt));
+        status = -1;
+    }
+
+    free(heads);
+    free(exits);
+    gcc_jit_context_release(cg.ctxt);
+
+    return status;
+}
+
+gcc_jit_lvalue* cell(struct jit_codegen* cg, int offset) {
+    gcc_jit_rvalue* index;
+
+    if (cg->absolute) {
+        index = constant(cg, cg->long_type, cg->pos + offset);
+    } else {
+        index = gcc_jit_lvalue_as_rvalue(cg->p);
+
+        if (offset) {
+            index = gcc_jit_context_new_binary_op(cg->ctxt, NULL, GCC_JIT_BINARY_OP_PLUS, cg->long_type, index, constant(cg, cg->long_type, offset));
+        }
+
+        /* The index is always kept masked, so the current cell needs no mask. */
+        if (cg->mask && offset) {
+            index = gcc_jit_context_new_binary_op(cg->ctxt, NULL, GCC_JIT_BINARY_OP_BITWISE_AND, cg->long_type, index, constant(cg, cg->long_type, cg->mask));
+        }
+    }
+
+    return gcc_jit_context_new_array_access(cg->ctxt, NULL, gcc_jit_lvalue_as_rvalue(cg->tape), index);
+}
+
+gcc_jit_rvalue* constant(struct jit_codegen* cg, gcc_jit_type* type, int value) {
+    return gcc_jit_context_new_rvalue_from_int(cg->ctxt, type, value);
+}
+
+gcc_jit_rvalue* cell_nonzero(struct jit_codegen* cg, int offset) {
+    return gcc_jit_context_new_comparison(cg->ctxt, NULL, GCC_JIT_COMPARISON_NE, gcc_jit_lvalue_as_rvalue(cell(cg, offset)), constant(cg, cg->byte_type, 0));
+}
+
+#else
+
+int generate_gccjit_binary(const struct bf_program* prog, const struct codegen_options* opts, const char* runtime_dir, const char* output) {
+    fprintf(stderr, "error: bfoc was built without libgccjit, rebuild with make GCCJIT=1\n");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * LLVM IR code generator. Emits textual IR with opaque pointers, the only
+ * pointer syntax LLVM 17 and later accept, for compilation with clang or
+ * opt and llc. LLVM 15 and 16 read it by default and LLVM 14 with
+ * -opaque-pointers, which bfoc passes it.
+ */
+
+#include "bfoc.h"
+
+#if defined(__x86_64__)
+#define LLVM_TARGET_TRIPLE "x86_64-pc-linux-gnu"
+#elif defined(__aarch64__)
+#define LLVM_TARGET_TRIPLE "aarch64-unknown-linux-gnu"
+#endif
+
+/**
+ * LLVM code generator state.
+ */
+struct llvm_codegen {
+    const struct codegen_options* opts;
+    FILE* out;
+    const char* tape; /* Tape array value, @tape or %tape */
+    int length;       /* Number of cells in the tape array */
+    int absolute;     /* Cell positions are static, address the tape directly */
+    int mask;         /* Tape index mask for circular tapes, 0 otherwise */
+    int pos;          /* Tape index of the current cell in absolute mode */
+    int next;         /* Next unused SSA value number */
+};
+
+/**
+ * Emits the address computation for the cell at <offset> from the current
+ * pointer position.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset
+ *
+ * @return SSA value number of the cell address
+ */
+static int cell_addr(struct llvm_codegen* cg, int offset);
+
+/**
+ * Emits a load of the cell at <offset>.
+ *
+ * @param cg     Code generator state
+ * @param offset Cell offset
+ *
+ * @return SSA value number of the loaded i8
+ */
+static int load_cell(struct llvm_codegen* cg, int offset);
+
+/**
+ * Emits a vector cell update as a single unaligned <N x i8> load, mask, add
+ * and store. Lanes wrap independently, as cells do.
+ *
+ * @param cg  Code generator state
+ * @param op  BF_OP_VEC operation
+ * @param vec Lane data
+ */
+static void emit_vec(struct llvm_codegen* cg, const struct bf_op* op, const struct bf_vec* vec);
+
+/**
+ * Writes a vector constant with one i8 element per lane.
+ *
+ * @param cg    Code generator state
+ * @param lanes Lane values
+ * @param n     Number of lanes
+ */
+static void write_vector(struct llvm_codegen* cg, const unsigned char* lanes, int n);
+
+/**
+ * Returns an 8-bit immediate as a signed value, the form LLVM prints i8
+ * constants in.
+ *
+ * @param value Immediate, taken modulo 256
+ */
+static int imm8(int value);
+
+int generate_llvm_source(const struct bf_program* prog, const struct codegen_options* opts, FILE* out) {
+    struct llvm_codegen cg = {
+        .opts     = opts,
+        .out      = out,
+        .tape     = "@tape",
+        .length   = opts->tape_length,
+        .absolute = opts->extent_known,
+        .mask     = opts->wrap ? opts->tape_length - 1 : 0,
+        .pos      = opts->extent_known ? -opts->extent_min : 0,
+        .next     = 0,
+    };
+
+    if (opts->extent_known) {
+        cg.length = opts->extent_max - opts->extent_min + 1;
+    }
+
+    /* Small static tapes live on the stack, where SROA splits them into
+     * scalars the same way gcc registerizes the local C tape. */
+    int local = cg.absolute && cg.length <= CODEGEN_REGISTER_TAPE_LENGTH;
+
+    if (local) {
+        cg.tape = "%tape";
+    }
+
+#ifdef LLVM_TARGET_TRIPLE
+    fprintf(out, "target triple = \"%s\"\n\n", LLVM_TARGET_TRIPLE);
+#endif
+
+    fprintf(out, "declare i32 @putchar(i32)\n");
+    fprintf(out, "declare i32 @getchar()\n");
+    fprintf(out, "declare void @llvm.memset.p0.i64(ptr, i8, i64, i1)\n");
+
+    if (opts->step_limit) {
+        fprintf(out, "declare void @bfrt_out_of_steps() noreturn\n");
+    }
+
+    if (opts->prefault) {
+        fprintf(out, "declare void @bfrt_prefault(ptr, i64, i32)\n");
+        fprintf(out, "declare void @bfrt_prefault_output(i32)\n");
+    }
+
+    fprintf(out, "\n");
+
+    /* An internal global is its own alias class: no call the program makes
+     * can reach it unless its address is passed out. */
+    if (!local) {
+        fprintf(out, "@tape = internal global [%d x i8] zeroinitializer, align 64\n\n", cg.length);
+    }
+
+    /* Step budget, charged at loop back edges. */
+    if (opts->step_limit) {
+        fprintf(out, "@steps = internal global i64 %ld\n\n", opts->step_limit);
+    }
+
+    fprintf(out, "define i32 @main() {\nentry:\n");
+
+    if (local) {
+        fprintf(out, "\t%%tape = alloca [%d x i8], align 16\n", cg.length);
+        fprintf(out, "\tcall void @llvm.memset.p0.i64(ptr align 16 %%tape, i8 0, i64 %d, i1 false)\n", cg.length);
+    }
+
+    /* The pointer lives in an alloca that mem2reg promotes to SSA form. */
+    if (!cg.absolute && cg.mask) {
+        fprintf(out, "\t%%p = alloca i64\n\tstore i64 0, ptr %%p\n");
+    } else if (!cg.absolute) {
+        fprintf(out, "\t%%ptr = alloca ptr\n");
+        fprintf(out, "\tstore ptr @tape, ptr %%ptr\n");
+    }
+
+    if (opts->prefault) {
+        fprintf(out, "\tcall void @bfrt_prefault_output(i32 %d)\n", opts->lock);
+
+        if (!local) {
+            fprintf(out, "\tcall void @bfrt_prefault(ptr @tape, i64 %d, i32 %d)\n", cg.length, opts->lock);
+        }
+    }
+
+    for (int i = 0; i < prog->len; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+        int addr, value, src;
+
+        switch (op->type) {
+        case BF_OP_ADD:
+            value = load_cell(&cg, op->offset);
+            addr = cell_addr(&cg, op->offset);
+            fprintf(out, "\t%%v%d = add i8 %%v%d, %d\n", cg.next, value, imm8(op->arg));
+            fprintf(out, "\tstore i8 %%v%d, ptr %%v%d, align 1, !tbaa !2\n", cg.next++, addr);
+            break;
+        case BF_OP_SET:
+            addr = cell_addr(&cg, op->offset);
+            fprintf(out, "\tstore i8 %d, ptr %%v%d, align 1, !tbaa !2\n", imm8(op->arg), addr);
+            break;
+        case BF_OP_MOVE:
+            if (cg.absolute) {
+                cg.pos += op->arg;
+            } else if (cg.mask) {
+                fprintf(out, "\t%%v%d = load i64, ptr %%p\n", cg.next);
+                fprintf(out, "\t%%v%d = add i64 %%v%d, %d\n", cg.next + 1, cg.next, op->arg);
+                fprintf(out, "\t%%v%d = and i64 %%v%d, %d\n", cg.next + 2, cg.next + 1, cg.mask);
+                fprintf(out, "\tstore i64 %%v%d, ptr %%p\n", cg.next + 2);
+                cg.next += 3;
+            } else {
+                addr = cell_addr(&cg, op->arg);
+                fprintf(out, "\tstore ptr %%v%d, ptr %%ptr\n", addr);
+            }
+            break;
+        case BF_OP_OUTPUT:
+            value = load_cell(&cg, op->offset);
+            fprintf(out, "\t%%v%d = zext i8 %%v%d to i32\n", cg.next, value);
+            fprintf(out, "\tcall i32 @putchar(i32 %%v%d)\n", cg.next++);
+            break;
+        case BF_OP_INPUT:
+            fprintf(out, "\t%%v%d = call i32 @getchar()\n", cg.next);
+            fprintf(out, "\t%%v%d = trunc i32 %%v%d to i8\n", cg.next + 1, cg.next);
+            value = cg.next + 1;
+            cg.next += 2;
+            addr = cell_addr(&cg, op->offset);
+            fprintf(out, "\tstore i8 %%v%d, ptr %%v%d, align 1, !tbaa !2\n", value, addr);
+            break;
+        case BF_OP_LOOP:
+            /* Header, body and exit blocks. The loop passes rotate the test
+             * to the bottom themselves. */
+            fprintf(out, "\tbr label %%loop%d\nloop%d:\n", i, i);
+            value = load_cell(&cg, op->offset);
+            fprintf(out, "\t%%v%d = icmp ne i8 %%v%d, 0\n", cg.next, value);
+            fprintf(out, "\tbr i1 %%v%d, label %%body%d, label %%exit%d\nbody%d:\n", cg.next++, i, i, i);
+            break;
+        case BF_OP_END:
+            if (opts->step_limit) {
+                fprintf(out, "\t%%v%d = load i64, ptr @steps\n", cg.next);
+                fprintf(out, "\t%%v%d = sub i64 %%v%d, %d\n", cg.next + 1, cg.next, bf_loop_cost(prog, op->match));
+                fprintf(out, "\tstore i64 %%v%d, ptr @steps\n", cg.next + 1);
+                fprintf(out, "\t%%v%d = icmp slt i64 %%v%d, 0\n", cg.next + 2, cg.next + 1);
+                fprintf(out, "\tbr i1 %%v%d, label %%steps%d, label %%latch%d\n", cg.next + 2, op->match, op->match);
+                fprintf(out, "steps%d:\n\tcall void @bfrt_out_of_steps()\n\tunreachable\nlatch%d:\n", op->match, op->match);
+                cg.next += 3;
+            }
+
+            fprintf(out, "\tbr label %%loop%d\nexit%d:\n", op->match, op->match);
+            break;
+        case BF_OP_MUL:
+            src = load_cell(&cg, op->src);
+            value = load_cell(&cg, op->offset);
+            addr = cell_addr(&cg, op->offset);
+            fprintf(out, "\t%%v%d = mul i8 %%v%d, %d\n", cg.next, src, imm8(op->arg));
+            fprintf(out, "\t%%v%d = add i8 %%v%d, %%v%d\n", cg.next + 1, value, cg.next);
+            fprintf(out, "\tstore i8 %%v%d, ptr %%v%d, align 1, !tbaa !2\n", cg.next + 1, addr);
+            cg.next += 2;
+            break;
+        case BF_OP_IF:
+            value = load_cell(&cg, op->offset);
+            fprintf(out, "\t%%v%d = icmp ne i8 %%v%d, 0\n", cg.next, value);
+            fprintf(out, "\tbr i1 %%v%d, label %%then%d, label %%endif%d\nthen%d:\n", cg.next++, i, i, i);
+            break;
+        case BF_OP_ENDIF:
+            fprintf(out, "\tbr label %%endif%d\nendif%d:\n", op->match, op->match);
+            break;
+        case BF_OP_VEC:
+            emit_vec(&cg, op, &prog->vecs[op->match]);
+            break;
+        }
+    }
+
+    fprintf(out, "\tret i32 0\n}\n\n");
+
+    /* Cells get a type of their own below the TBAA root. */
+    fprintf(out, "!0 = !{!\"bfoc tbaa\"}\n");
+    fprintf(out, "!1 = !{!\"tape cell\", !0, i64 0}\n");
+    fprintf(out, "!2 = !{!1, !1, i64 0}\n");
+
+    return 0;
+}
+
+int cell_addr(struct llvm_codegen* cg, int offset) {
+    if (cg->absolute) {
+        fprintf(cg->out, "\t%%v%d = getelementptr inbounds [%d x i8], ptr %s, i64 0, i64 %d\n", cg->next, cg->length, cg->tape, cg->pos + offset);
+    } else if (cg->mask) {
+        fprintf(cg->out, "\t%%v%d = load i64, ptr %%p\n", cg->next);
+        fprintf(cg->out, "\t%%v%d = add i64 %%v%d, %d\n", cg->next + 1, cg->next, offset);
+        fprintf(cg->out, "\t%%v%d = and i64 %%v%d, %d\n", cg->next + 2, cg->next + 1, cg->mask);
+        fprintf(cg->out, "\t%%v%d = getelementptr inbounds [%d x i8], ptr @tape, i64 0, i64 %%v%d\n", cg->next + 3, cg->length, cg->next + 2);
+        cg->next += 3;
+    } else {
+        fprintf(cg->out, "\t%%v%d = load ptr, ptr %%ptr\n", cg->next);
+        fprintf(cg->out, "\t%%v%d = getelementptr inbounds i8, ptr %%v%d, i64 %d\n", cg->next + 1, cg->next, offset);
+        cg->next += 1;
+    }
+
+    return cg->next++;
+}
+
+int load_cell(struct llvm_codegen* cg, int offset) {
+    int addr = cell_addr(cg, offset);
+
+    fprintf(cg->out, "\t%%v%d = load i8, ptr %%v%d, align 1, !tbaa !2\n", cg->next, addr);
+    return cg->next++;
+}
+
+void emit_vec(struct llvm_codegen* cg, const struct bf_op* op, const struct bf_vec* vec) {
+    int adds = 0, sets = 0;
+
+    for (int i = 0; i < op->arg; ++i) {
+        if (vec->mask[i]) ++adds; else ++sets;
+    }
+
+    /* A circular tape can wrap in the middle of the vector. */
+    if (cg->mask && !cg->absolute) {
+        for (int i = 0; i < op->arg; ++i) {
+            if (vec->mask[i] == 0xff && !vec->add[i]) {
+                continue;
+            }
+
+            int value = vec->mask[i] ? load_cell(cg, op->offset + i) : -1;
+            int addr = cell_addr(cg, op->offset + i);
+
+            if (vec->mask[i]) {
+                fprintf(cg->out, "\t%%v%d = add i8 %%v%d, %d\n", cg->next, value, imm8(vec->add[i]));
+                fprintf(cg->out, "\tstore i8 %%v%d, ptr %%v%d, align 1, !tbaa !2\n", cg->next++, addr);
+            } else {
+                fprintf(cg->out, "\tstore i8 %d, ptr %%v%d, align 1, !tbaa !2\n", imm8(vec->add[i]), addr);
+            }
+        }
+
+        return;
+    }
+
+    int addr = cell_addr(cg, op->offset);
+    int value;
+
+    /* All-set vectors don't need the old cells. */
+    if (adds) {
+        fprintf(cg->out, "\t%%v%d = load <%d x i8>, ptr %%v%d, align 1, !tbaa !2\n", cg->next, op->arg, addr);
+        value = cg->next++;
+
+        if (sets) {
+            fprintf(cg->out, "\t%%v%d = and <%d x i8> %%v%d, ", cg->next, op->arg, value);
+            write_vector(cg, vec->mask, op->arg);
+            fprintf(cg->out, "\n");
+            value = cg->next++;
+        }
+
+        fprintf(cg->out, "\t%%v%d = add <%d x i8> %%v%d, ", cg->next, op->arg, value);
+        write_vector(cg, vec->add, op->arg);
+        fprintf(cg->out, "\n");
+        value = cg->next++;
+
+        fprintf(cg->out, "\tstore <%d x i8> %%v%d, ptr %%v%d, align 1, !tbaa !2\n", op->arg, value, addr);
+    } else {
+        fprintf(cg->out, "\tstore <%d x i8> ", op->arg);
+        write_vector(cg, vec->add, op->arg);
+        fprintf(cg->out, ", ptr %%v%d, align 1, !tbaa !2\n", addr);
+    }
+}
+
+void write_vector(struct llvm_codegen* cg, const unsigned char* lanes, int n) {
+    fprintf(cg->out, "<");
+
+    for (int i = 0; i < n; ++i) {
+        fprintf(cg->out, "%si8 %d", i ? ", " : "", imm8(lanes[i]));
+    }
+
+    fprintf(cg->out, ">");
+}
+
+int imm8(int value) {
+    value &= 0xff;
+    return value < 128 ? value : value - 256;
+}
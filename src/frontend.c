@@ -0,0 +1,128 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Compiler front end. Reads brainfuck source and runs it through the
+ * optimizer pipeline, shared by bfoc and the fuzzing harness so the
+ * fuzzed path is the one that ships.
+ */
+
+#include "bfoc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_INPUT_BUF   256
+
+int bf_read_source(FILE* in, char** source, int* len) {
+    int c, size = INITIAL_INPUT_BUF;
+    char* buf = malloc(size);
+
+    *len = 0;
+
+    if (!buf) {
+        fprintf(stderr, "error: out of memory reading source\n");
+        return -1;
+    }
+
+    while ((c = fgetc(in)) != EOF) {
+        /* Ignore invalid characters early to keep the buffer clean. */
+        switch (c) {
+        case '+':
+        case '-':
+        case '>':
+        case '<':
+        case '[':
+        case ']':
+        case '.':
+        case ',':
+            break;
+        default:
+            continue;
+        }
+
+        buf[(*len)++] = c;
+
+        if (*len >= size) {
+            char* grown = realloc(buf, size * 2);
+
+            if (!grown) {
+                fprintf(stderr, "error: out of memory reading source\n");
+                free(buf);
+                return -1;
+            }
+
+            buf = grown;
+            size *= 2;
+        }
+    }
+
+    buf[*len] = '\0';
+    *source = buf;
+
+    return 0;
+}
+
+int bf_optimize_source(const char* source, int len, struct codegen_options* opts, struct bf_program* prog) {
+    /* Static optimization rewrites its buffer in place. */
+    char* buf = malloc(len + 1);
+    memcpy(buf, source, len + 1);
+
+    bf_static_optimize(buf, len);
+
+    if (bf_parse(buf, len, prog)) {
+        fprintf(stderr, "error: parsing failed. stopping..\n");
+        free(buf);
+        return -1;
+    }
+
+    free(buf);
+
+    bf_fold_blocks(prog);
+
+    /* Hoisted updates become multiplies and guarded stores, which have
+     * no brainfuck form. */
+    if (opts->backend != BACKEND_BF) {
+        bf_hoist_invariants(prog);
+    }
+
+    bf_convert_once_loops(prog);
+
+    /* Loops run at compile time would never be charged to the step
+     * budget, so programs with one run from the start. */
+    if (!opts->step_limit) {
+        bf_evaluate_prefix(prog, opts->tape_length);
+    }
+
+    bf_fold_blocks(prog);
+
+    if (!opts->no_vectorize) {
+        bf_vectorize(prog);
+    }
+
+    /* Circular tapes are rounded up to a power of two so the pointer can
+     * be wrapped with a mask. */
+    if (opts->wrap && (opts->tape_length & (opts->tape_length - 1))) {
+        int length = 1;
+        while (length < opts->tape_length) length <<= 1;
+
+        fprintf(stderr, "info: rounded circular tape length %d up to %d\n", opts->tape_length, length);
+        opts->tape_length = length;
+    }
+
+    /* Shrink the tape to the cells the program can touch when that is
+     * known statically. A circular tape smaller than the extent aliases
+     * cells, so it is kept whole in that case. */
+    if (!bf_tape_extent(prog, &opts->extent_min, &opts->extent_max)) {
+        fprintf(stderr, "info: static tape extent %d..%d (%d cells)\n", opts->extent_min, opts->extent_max, opts->extent_max - opts->extent_min + 1);
+        opts->extent_known = !opts->wrap || opts->extent_max - opts->extent_min < opts->tape_length;
+    }
+
+    /* A profile of a different program would put hints in the wrong places. */
+    if (opts->profile && opts->profile->len != bf_profile_sites(prog)) {
+        fprintf(stderr, "warning: branch profile doesn't match the program, ignoring it\n");
+        opts->profile = NULL;
+    }
+
+    return 0;
+}
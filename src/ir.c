@@ -0,0 +1,182 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Intermediate representation construction.
+ */
+
+#include "bfoc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_PROGRAM_CAP 256
+
+int bf_parse(const char* input_buf, int input_len, struct bf_program* prog) {
+    int run, start, end;
+    const char* ops;
+
+    /* Open loops, as operation indices and source locations for error
+     * reporting. */
+    int* loop_stack = malloc(sizeof(int) * (input_len + 1));
+    int* loop_source = malloc(sizeof(int) * (input_len + 1));
+    int loop_depth = 0;
+
+    prog->ops = NULL;
+    prog->len = prog->cap = 0;
+    prog->vecs = NULL;
+    prog->vecs_len = prog->vecs_cap = 0;
+
+    /* Don't increment i in the loop condition, as most of the cases
+     * will increment it during scanning logic anyway. */
+    for (int i = 0; i < input_len;) {
+        char c = input_buf[i];
+
+        switch (c) {
+        case '+':
+        case '-':
+        case '>':
+        case '<':
+            /* Walk through the run of updates or moves and bundle it into
+             * one operation. Opposing operators cancel out, and no-ops in
+             * between don't end the run. */
+            ops = c == '+' || c == '-' ? "+-" : "><";
+            run = 0;
+
+            for (; i < input_len; ++i) {
+                if (input_buf[i] == ops[0]) {
+                    ++run;
+                } else if (input_buf[i] == ops[1]) {
+                    --run;
+                } else if (memchr("+-<>[].,z", input_buf[i], 9)) {
+                    break;
+                }
+            }
+
+            /* Cells wrap, so only the net update modulo 256 matters. Runs
+             * that cancel out are dropped entirely. */
+            if (*ops == '+') {
+                run = ((run % 256) + 256) % 256;
+                if (run > 128) run -= 256;
+            }
+
+            if (run) {
+                bf_append(prog, *ops == '+' ? BF_OP_ADD : BF_OP_MOVE, 0, run);
+            }
+            break;
+        case '.':
+            bf_append(prog, BF_OP_OUTPUT, 0, 0);
+            ++i;
+            break;
+        case ',':
+            bf_append(prog, BF_OP_INPUT, 0, 0);
+            ++i;
+            break;
+        case '[':
+            loop_source[loop_depth] = i++;
+            loop_stack[loop_depth++] = bf_append(prog, BF_OP_LOOP, 0, 0);
+            break;
+        case ']':
+            if (!loop_depth) {
+                fprintf(stderr, "error: failed to match loop end at location %d\n", i);
+                free(loop_stack);
+                free(loop_source);
+                bf_free(prog);
+                return -1;
+            }
+
+            start = loop_stack[--loop_depth];
+            end = bf_append(prog, BF_OP_END, 0, 0);
+            prog->ops[start].match = end;
+            prog->ops[end].match = start;
+            ++i;
+            break;
+        case 'z':
+            /* Cell zero instruction */
+            bf_append(prog, BF_OP_SET, 0, 0);
+            ++i;
+            break;
+        default:
+            /* Any no-ops will fall here (from static optimization) */
+            ++i;
+        }
+    }
+
+    if (loop_depth) {
+        fprintf(stderr, "error: failed to match loop start at location %d\n", loop_source[loop_depth - 1]);
+        free(loop_stack);
+        free(loop_source);
+        bf_free(prog);
+        return -1;
+    }
+
+    free(loop_stack);
+    free(loop_source);
+    return 0;
+}
+
+int bf_append(struct bf_program* prog, enum bf_op_type type, int offset, int arg) {
+    if (prog->len >= prog->cap) {
+        prog->cap = prog->cap ? prog->cap * 2 : INITIAL_PROGRAM_CAP;
+        prog->ops = realloc(prog->ops, sizeof(struct bf_op) * prog->cap);
+    }
+
+    struct bf_op* op = &prog->ops[prog->len];
+
+    op->type = type;
+    op->offset = offset;
+    op->arg = arg;
+    op->match = -1;
+    op->src = 0;
+
+    return prog->len++;
+}
+
+int bf_append_copy(struct bf_program* prog, const struct bf_program* from, const struct bf_op* op, int move) {
+    int index = bf_append(prog, op->type, op->offset + move, op->arg);
+
+    prog->ops[index].src = op->src + move;
+
+    if (op->type == BF_OP_VEC) {
+        prog->ops[index].match = bf_append_vec(prog, &from->vecs[op->match]);
+    }
+
+    return index;
+}
+
+int bf_append_vec(struct bf_program* prog, const struct bf_vec* vec) {
+    if (prog->vecs_len >= prog->vecs_cap) {
+        prog->vecs_cap = prog->vecs_cap ? prog->vecs_cap * 2 : INITIAL_PROGRAM_CAP;
+        prog->vecs = realloc(prog->vecs, sizeof(struct bf_vec) * prog->vecs_cap);
+    }
+
+    prog->vecs[prog->vecs_len] = *vec;
+    return prog->vecs_len++;
+}
+
+void bf_rematch(struct bf_program* prog) {
+    int* loop_stack = malloc(sizeof(int) * (prog->len + 1));
+    int loop_depth = 0;
+
+    for (int i = 0; i < prog->len; ++i) {
+        if (prog->ops[i].type == BF_OP_LOOP || prog->ops[i].type == BF_OP_IF) {
+            loop_stack[loop_depth++] = i;
+        } else if (prog->ops[i].type == BF_OP_END || prog->ops[i].type == BF_OP_ENDIF) {
+            int start = loop_stack[--loop_depth];
+
+            prog->ops[start].match = i;
+            prog->ops[i].match = start;
+        }
+    }
+
+    free(loop_stack);
+}
+
+void bf_free(struct bf_program* prog) {
+    free(prog->ops);
+    free(prog->vecs);
+    prog->ops = NULL;
+    prog->len = prog->cap = 0;
+    prog->vecs = NULL;
+    prog->vecs_len = prog->vecs_cap = 0;
+}
@@ -0,0 +1,941 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Static optimization and analysis passes.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bfoc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A pending cell update in a straight-line block.
+ */
+struct cell_update {
+    int offset; /* Cell offset from the pointer at the start of the block */
+    int seq;    /* Order of the update within the block */
+    int set;    /* Nonzero for an assignment, zero for an addition */
+    int value;
+};
+
+/**
+ * Orders cell updates by offset, keeping program order for each cell.
+ */
+static int compare_updates(const void* a, const void* b);
+
+/**
+ * Emits the pending updates of a block in offset order, merging the
+ * updates to each cell into a single operation. Updates that cancel out
+ * are dropped.
+ *
+ * @param out     Program to append to
+ * @param updates Pending updates, sorted in-place
+ * @param count   Number of pending updates, reset to 0
+ */
+static void flush_updates(struct bf_program* out, struct cell_update* updates, int* count);
+
+/**
+ * Appends the vector updates for a cluster of cell updates at neighbouring
+ * offsets. Lanes left over after the widest vectors that fit are appended
+ * as scalar operations.
+ *
+ * @param out   Program to append to
+ * @param ops   Sorted ADD and SET operations in the cluster
+ * @param count Number of operations
+ */
+static void emit_cluster(struct bf_program* out, const struct bf_op* ops, int count);
+
+/**
+ * Kinds of cell access recorded by loop-invariant code motion.
+ */
+enum access_kind {
+    ACCESS_READ,  /* Value is observed */
+    ACCESS_ADD,   /* Constant added at the top level of the loop body */
+    ACCESS_SET,   /* Constant stored at the top level of the loop body */
+    ACCESS_WRITE, /* Any other modification */
+};
+
+/**
+ * A cell access from a loop body, relative to the pointer at loop entry.
+ */
+struct cell_access {
+    int offset;
+    enum access_kind kind;
+    int value;
+};
+
+/**
+ * Summary of the accesses to one cell from a loop body.
+ */
+struct cell_summary {
+    int offset;
+    int reads, writes, adds, sets;
+    int add_sum;
+    int set_value;
+    enum { MOVED_NONE, MOVED_SINK, MOVED_HOIST } moved;
+};
+
+/**
+ * Orders cell accesses by offset.
+ */
+static int compare_accesses(const void* a, const void* b);
+
+/**
+ * Orders cell summaries by offset.
+ */
+static int compare_summaries(const void* a, const void* b);
+
+/**
+ * Appends prog->ops[start, end) to <out> with loop-invariant code motion
+ * applied to every loop, innermost loops first.
+ *
+ * @param prog  Program to read from
+ * @param start First operation
+ * @param end   One past the last operation
+ * @param out   Program to append to
+ * @param count Incremented for every loop that was changed
+ */
+static void hoist_range(const struct bf_program* prog, int start, int end, struct bf_program* out, int* count);
+
+/**
+ * Appends a loop with the given (already optimized) body to <out>, moving
+ * invariant cell updates out of it where possible.
+ *
+ * @param body  Loop body
+ * @param out   Program to append to
+ * @param count Incremented if the loop was changed
+ */
+static void hoist_loop(const struct bf_program* body, struct bf_program* out, int* count);
+
+/**
+ * Returns the multiplicative inverse of an odd number modulo 256.
+ */
+static int inverse_mod256(int n);
+
+/**
+ * A cell value overwritten during compile-time evaluation.
+ */
+struct cell_write {
+    int cell;
+    unsigned char value;
+};
+
+/**
+ * Compile-time evaluation state.
+ */
+struct eval_state {
+    unsigned char* tape;
+    int length;
+    int pos;
+    unsigned char* output;
+    int output_len;
+    long steps;
+
+    /* Old values of the cells written since the last top-level snapshot */
+    struct cell_write* undo;
+    int undo_len;
+    int undo_cap;
+};
+
+/**
+ * Executes one operation at compile time and advances the instruction
+ * index. Operations that read input, leave the tape or exceed the
+ * evaluation limits are not executed.
+ *
+ * @param st   Evaluation state
+ * @param prog Program being evaluated
+ * @param ip   Index of the operation, updated to the next one to execute
+ *
+ * @return 0 if the operation was executed, -1 otherwise
+ */
+static int eval_step(struct eval_state* st, const struct bf_program* prog, int* ip);
+
+/**
+ * Writes a cell during compile-time evaluation, logging the old value.
+ *
+ * @param st    Evaluation state
+ * @param cell  Tape index
+ * @param value New value
+ */
+static void eval_write(struct eval_state* st, int cell, int value);
+
+/**
+ * Returns nonzero if a loop is known to run at most once: its body leaves
+ * the pointer where it found it and always leaves the condition cell zero.
+ *
+ * @param prog Program to read from
+ * @param loop Index of the BF_OP_LOOP operation
+ */
+static int runs_once(const struct bf_program* prog, int loop);
+
+void bf_static_optimize(char* input_buf, int input_len) {
+        /*
+         * 1: Fast cell zeroing
+         * A common patten in BF programs is "[-]" which sets the current cell
+         * value to 0 via a loop. This can be reduced to one instruction to
+         * improve performance.
+         */
+
+        int cell_zero_count = 0;
+
+        /*
+         * One pass over the buffer, so the cost stays linear in its length.
+         * Everything that isn't a command is blanked first, or a 'z' in a
+         * comment would be taken for a cell zero instruction.
+         */
+        for (int i = 0; i < input_len; ++i) {
+                if (!memchr("+-<>[].,", input_buf[i], 8)) {
+                        input_buf[i] = ' ';
+                } else if (i + 2 < input_len && !memcmp(input_buf + i, "[-]", 3)) {
+                        input_buf[i] = 'z';     /* cell zero instruction */
+                        input_buf[i + 1] = ' '; /* replace the others with no-ops */
+                        input_buf[i + 2] = ' ';
+                        cell_zero_count++;
+                        i += 2;
+                }
+        }
+
+        if (cell_zero_count) {
+                fprintf(stderr, "info: performed %d cell-zero optimizations\n", cell_zero_count);
+        }
+}
+
+int bf_tape_extent(const struct bf_program* prog, int* min, int* max) {
+    int pos = 0, depth = 0, result = 0;
+    int* loop_entry = malloc(sizeof(int) * (prog->len + 1));
+
+    /* Only accessed cells count towards the extent, the pointer itself may
+     * wander anywhere in between. A program with no accesses still gets
+     * the starting cell. */
+    *min = *max = 0;
+
+    for (int i = 0; i < prog->len && !result; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+        int cell = pos + op->offset;
+
+        switch (op->type) {
+        case BF_OP_MOVE:
+            pos += op->arg;
+            continue;
+        case BF_OP_VEC:
+            /* Covers arg cells starting at the offset. */
+            if (cell + op->arg - 1 > *max) *max = cell + op->arg - 1;
+            break;
+        case BF_OP_MUL:
+            if (pos + op->src < *min) *min = pos + op->src;
+            if (pos + op->src > *max) *max = pos + op->src;
+            break;
+        case BF_OP_LOOP:
+        case BF_OP_IF:
+            loop_entry[depth++] = pos;
+            break;
+        case BF_OP_END:
+        case BF_OP_ENDIF:
+            /*
+             * The pointer must be back where the loop started, otherwise the
+             * position after the loop depends on the trip count. Balanced
+             * loops repeat the same accesses on every iteration, so one pass
+             * over the body covers them all.
+             */
+            if (pos != loop_entry[--depth]) {
+                result = -1;
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (cell < *min) *min = cell;
+        if (cell > *max) *max = cell;
+    }
+
+    free(loop_entry);
+    return result;
+}
+
+int bf_loop_cost(const struct bf_program* prog, int loop) {
+    int cost = 1;
+
+    for (int i = loop + 1; i < prog->ops[loop].match; ++i) {
+        ++cost;
+
+        if (prog->ops[i].type == BF_OP_LOOP) {
+            i = prog->ops[i].match;
+        }
+    }
+
+    return cost;
+}
+
+int bf_split_regions(const struct bf_program* prog, int** starts) {
+    int count = 1;
+
+    *starts = malloc(sizeof(int) * (prog->len + 1));
+    (*starts)[0] = 0;
+
+    for (int i = 0; i < prog->len; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+        unsigned hash = 2166136261u;
+
+        if (op->type != BF_OP_LOOP && op->type != BF_OP_IF) {
+            continue;
+        }
+
+        for (int j = i; j <= op->match; ++j) {
+            hash = (hash ^ prog->ops[j].type) * 16777619u;
+            hash = (hash ^ (unsigned) prog->ops[j].offset) * 16777619u;
+            hash = (hash ^ (unsigned) prog->ops[j].arg) * 16777619u;
+        }
+
+        i = op->match;
+
+        if (!(hash % BF_REGION_SPREAD) && i + 1 < prog->len) {
+            (*starts)[count++] = i + 1;
+        }
+    }
+
+    return count;
+}
+
+void bf_fold_blocks(struct bf_program* prog) {
+    struct bf_program out = { 0 };
+    struct cell_update* updates = malloc(sizeof(struct cell_update) * (prog->len + 1));
+    int count = 0, move = 0;
+
+    for (int i = 0; i < prog->len; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+
+        switch (op->type) {
+        case BF_OP_ADD:
+        case BF_OP_SET:
+            updates[count].offset = move + op->offset;
+            updates[count].seq = count;
+            updates[count].set = op->type == BF_OP_SET;
+            updates[count].value = op->arg;
+            ++count;
+            break;
+        case BF_OP_MOVE:
+            move += op->arg;
+            break;
+        case BF_OP_OUTPUT:
+        case BF_OP_INPUT:
+        case BF_OP_VEC:
+        case BF_OP_MUL:
+            flush_updates(&out, updates, &count);
+            bf_append_copy(&out, prog, op, move);
+            break;
+        case BF_OP_LOOP:
+        case BF_OP_END:
+        case BF_OP_IF:
+        case BF_OP_ENDIF:
+            /* Loops test the cell under the pointer, so the pointer has to
+             * catch up before the block ends. */
+            flush_updates(&out, updates, &count);
+
+            if (move) {
+                bf_append(&out, BF_OP_MOVE, 0, move);
+                move = 0;
+            }
+
+            bf_append(&out, op->type, 0, 0);
+            break;
+        }
+    }
+
+    /* A move at the very end of the program is never observed. */
+    flush_updates(&out, updates, &count);
+    free(updates);
+
+    bf_rematch(&out);
+    bf_free(prog);
+    *prog = out;
+}
+
+void bf_vectorize(struct bf_program* prog) {
+    struct bf_program out = { 0 };
+    int vectors = 0;
+
+    for (int i = 0; i < prog->len;) {
+        const struct bf_op* op = &prog->ops[i];
+
+        if (op->type != BF_OP_ADD && op->type != BF_OP_SET) {
+            bf_append_copy(&out, prog, op, 0);
+            ++i;
+            continue;
+        }
+
+        /*
+         * Take the cluster of updates starting here: increasing offsets with
+         * at most one untouched cell between neighbours. Untouched cells
+         * become identity lanes.
+         */
+        int end = i + 1;
+        while (end < prog->len
+               && (prog->ops[end].type == BF_OP_ADD || prog->ops[end].type == BF_OP_SET)
+               && prog->ops[end].offset > prog->ops[end - 1].offset
+               && prog->ops[end].offset - prog->ops[end - 1].offset <= 2) {
+            ++end;
+        }
+
+        if (end - i >= 3 && prog->ops[end - 1].offset - op->offset + 1 >= BF_VEC_MIN_SPAN) {
+            emit_cluster(&out, op, end - i);
+            ++vectors;
+        } else {
+            for (int j = i; j < end; ++j) {
+                bf_append(&out, prog->ops[j].type, prog->ops[j].offset, prog->ops[j].arg);
+            }
+        }
+
+        i = end;
+    }
+
+    if (vectors) {
+        fprintf(stderr, "info: vectorized %d runs of neighbouring cell updates\n", vectors);
+    }
+
+    bf_rematch(&out);
+    bf_free(prog);
+    *prog = out;
+}
+
+int compare_updates(const void* a, const void* b) {
+    const struct cell_update* x = a;
+    const struct cell_update* y = b;
+
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+void flush_updates(struct bf_program* out, struct cell_update* updates, int* count) {
+    qsort(updates, *count, sizeof(struct cell_update), compare_updates);
+
+    for (int i = 0; i < *count;) {
+        int set = 0, value = 0, offset = updates[i].offset;
+
+        for (; i < *count && updates[i].offset == offset; ++i) {
+            if (updates[i].set) {
+                set = 1;
+                value = updates[i].value;
+            } else {
+                value += updates[i].value;
+            }
+        }
+
+        /* Cells are 8 bits wide, keep additions in -128..127. */
+        value &= 0xff;
+
+        if (set) {
+            bf_append(out, BF_OP_SET, offset, value);
+        } else if (value) {
+            bf_append(out, BF_OP_ADD, offset, value > 127 ? value - 256 : value);
+        }
+    }
+
+    *count = 0;
+}
+
+void emit_cluster(struct bf_program* out, const struct bf_op* ops, int count) {
+    int start = ops[0].offset;
+    int span = ops[count - 1].offset - start + 1;
+    int j = 0;
+
+    while (span >= BF_VEC_MIN_SPAN) {
+        int width = BF_VEC_MAX_LANES;
+        struct bf_vec vec;
+
+        while (width > span) width /= 2;
+
+        memset(vec.mask, 0xff, sizeof vec.mask);
+        memset(vec.add, 0, sizeof vec.add);
+
+        for (; j < count && ops[j].offset < start + width; ++j) {
+            int lane = ops[j].offset - start;
+
+            vec.mask[lane] = ops[j].type == BF_OP_SET ? 0 : 0xff;
+            vec.add[lane] = ops[j].arg & 0xff;
+        }
+
+        int index = bf_append(out, BF_OP_VEC, start, width);
+        out->ops[index].match = bf_append_vec(out, &vec);
+
+        start += width;
+        span -= width;
+    }
+
+    for (; j < count; ++j) {
+        bf_append(out, ops[j].type, ops[j].offset, ops[j].arg);
+    }
+}
+
+void bf_hoist_invariants(struct bf_program* prog) {
+    struct bf_program out = { 0 };
+    int count = 0;
+
+    hoist_range(prog, 0, prog->len, &out, &count);
+
+    if (count) {
+        fprintf(stderr, "info: moved invariant cell updates out of %d loops\n", count);
+    }
+
+    bf_rematch(&out);
+    bf_free(prog);
+    *prog = out;
+}
+
+int compare_accesses(const void* a, const void* b) {
+    const struct cell_access* x = a;
+    const struct cell_access* y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+int compare_summaries(const void* a, const void* b) {
+    const struct cell_summary* x = a;
+    const struct cell_summary* y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+void hoist_range(const struct bf_program* prog, int start, int end, struct bf_program* out, int* count) {
+    for (int i = start; i < end; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+
+        if (op->type == BF_OP_LOOP) {
+            struct bf_program body = { 0 };
+
+            hoist_range(prog, i + 1, op->match, &body, count);
+            bf_rematch(&body);
+            hoist_loop(&body, out, count);
+            bf_free(&body);
+
+            i = op->match;
+        } else {
+            bf_append_copy(out, prog, op, 0);
+        }
+    }
+}
+
+void hoist_loop(const struct bf_program* body, struct bf_program* out, int* count) {
+    struct cell_access* accesses = malloc(sizeof(struct cell_access) * (body->len * BF_VEC_MAX_LANES + 1));
+    struct cell_summary* cells = malloc(sizeof(struct cell_summary) * (body->len * BF_VEC_MAX_LANES + 1));
+    int* entry = malloc(sizeof(int) * (body->len + 1));
+    int naccesses = 0, ncells = 0, depth = 0, pos = 0, balanced = 1;
+    int trip_factor = 0, moved = 0, cleared = 1;
+
+    /* The loop condition reads the cell under the pointer. */
+    accesses[naccesses++] = (struct cell_access) { 0, ACCESS_READ, 0 };
+
+    for (int i = 0; i < body->len && balanced; ++i) {
+        const struct bf_op* op = &body->ops[i];
+        int cell = pos + op->offset;
+
+        switch (op->type) {
+        case BF_OP_ADD:
+        case BF_OP_SET:
+            if (depth) {
+                accesses[naccesses++] = (struct cell_access) { cell, ACCESS_WRITE, 0 };
+            } else {
+                accesses[naccesses++] = (struct cell_access) { cell, op->type == BF_OP_ADD ? ACCESS_ADD : ACCESS_SET, op->arg };
+            }
+            break;
+        case BF_OP_MOVE:
+            pos += op->arg;
+            break;
+        case BF_OP_OUTPUT:
+            accesses[naccesses++] = (struct cell_access) { cell, ACCESS_READ, 0 };
+            break;
+        case BF_OP_INPUT:
+            accesses[naccesses++] = (struct cell_access) { cell, ACCESS_WRITE, 0 };
+            break;
+        case BF_OP_VEC:
+            for (int lane = 0; lane < op->arg; ++lane) {
+                accesses[naccesses++] = (struct cell_access) { cell + lane, ACCESS_WRITE, 0 };
+            }
+            break;
+        case BF_OP_MUL:
+            accesses[naccesses++] = (struct cell_access) { pos + op->src, ACCESS_READ, 0 };
+            accesses[naccesses++] = (struct cell_access) { cell, ACCESS_WRITE, 0 };
+            break;
+        case BF_OP_LOOP:
+        case BF_OP_IF:
+            accesses[naccesses++] = (struct cell_access) { cell, ACCESS_READ, 0 };
+            entry[depth++] = pos;
+            break;
+        case BF_OP_END:
+        case BF_OP_ENDIF:
+            /* Cell offsets past an unbalanced inner loop are unknown. */
+            balanced = entry[--depth] == pos;
+            break;
+        }
+    }
+
+    balanced = balanced && !pos;
+
+    if (balanced) {
+        /* Summarize the accesses to each cell. */
+        qsort(accesses, naccesses, sizeof(struct cell_access), compare_accesses);
+
+        for (int i = 0; i < naccesses; ++i) {
+            struct cell_summary* c = &cells[ncells];
+
+            if (!i || accesses[i].offset != accesses[i - 1].offset) {
+                memset(c, 0, sizeof *c);
+                c->offset = accesses[i].offset;
+                ++ncells;
+            } else {
+                c = &cells[ncells - 1];
+            }
+
+            switch (accesses[i].kind) {
+            case ACCESS_READ:  ++c->reads; break;
+            case ACCESS_WRITE: ++c->writes; break;
+            case ACCESS_ADD:   ++c->adds; c->add_sum += accesses[i].value; break;
+            case ACCESS_SET:   ++c->sets; c->set_value = accesses[i].value; break;
+            }
+        }
+
+        /*
+         * The condition cell only stepping by an odd constant gives a trip
+         * count of cell * -step^-1 (mod 256) for any nonzero entry value, so
+         * accumulating cells can be sunk as a multiply-add of the condition
+         * cell on entry.
+         */
+        struct cell_summary* cond = bsearch(&(struct cell_summary) { .offset = 0 }, cells, ncells, sizeof(struct cell_summary), compare_summaries);
+
+        if (!cond->writes && !cond->sets && (cond->add_sum & 1)) {
+            trip_factor = (256 - inverse_mod256(cond->add_sum & 0xff)) & 0xff;
+        }
+
+        for (int i = 0; i < ncells; ++i) {
+            struct cell_summary* c = &cells[i];
+
+            if (c == cond || c->reads || c->writes) {
+                continue;
+            }
+
+            if (!c->sets && trip_factor) {
+                c->moved = MOVED_SINK;
+            } else if (c->sets == 1 && !c->adds) {
+                /* A lone constant store, only valid once the loop has run. */
+                c->moved = MOVED_HOIST;
+            }
+
+            moved += !!c->moved;
+        }
+    }
+
+    /* Sunk accumulators first, they need the condition cell's entry value. */
+    for (int i = 0; i < ncells; ++i) {
+        int factor = (cells[i].add_sum * trip_factor) & 0xff;
+
+        if (cells[i].moved == MOVED_SINK && factor) {
+            int index = bf_append(out, BF_OP_MUL, cells[i].offset, factor > 127 ? factor - 256 : factor);
+            out->ops[index].src = 0;
+        }
+    }
+
+    for (int i = 0, guarded = 0; i < ncells; ++i) {
+        if (cells[i].moved == MOVED_HOIST) {
+            if (!guarded++) {
+                bf_append(out, BF_OP_IF, 0, 0);
+            }
+
+            bf_append(out, BF_OP_SET, cells[i].offset, cells[i].set_value);
+        }
+
+        if (i == ncells - 1 && guarded) {
+            bf_append(out, BF_OP_ENDIF, 0, 0);
+        }
+    }
+
+    /* Copy what is left of the body. A body left with nothing but the
+     * condition step runs the cell down to zero. */
+    struct bf_program rest = { 0 };
+
+    pos = depth = 0;
+
+    for (int i = 0; i < body->len; ++i) {
+        const struct bf_op* op = &body->ops[i];
+
+        if (moved && !depth && (op->type == BF_OP_ADD || op->type == BF_OP_SET)) {
+            struct cell_summary* c = bsearch(&(struct cell_summary) { .offset = pos + op->offset }, cells, ncells, sizeof(struct cell_summary), compare_summaries);
+
+            if (c->moved) {
+                continue;
+            }
+        }
+
+        if (op->type == BF_OP_MOVE) pos += op->arg;
+        if (op->type == BF_OP_LOOP || op->type == BF_OP_IF) ++depth;
+        if (op->type == BF_OP_END || op->type == BF_OP_ENDIF) --depth;
+
+        if (op->type != BF_OP_ADD || op->offset) {
+            cleared = 0;
+        }
+
+        bf_append_copy(&rest, body, op, 0);
+    }
+
+    if (balanced && cleared && trip_factor) {
+        bf_append(out, BF_OP_SET, 0, 0);
+    } else {
+        bf_append(out, BF_OP_LOOP, 0, 0);
+
+        for (int i = 0; i < rest.len; ++i) {
+            bf_append_copy(out, &rest, &rest.ops[i], 0);
+        }
+
+        bf_append(out, BF_OP_END, 0, 0);
+    }
+
+    if (moved || (balanced && cleared && trip_factor)) {
+        ++*count;
+    }
+
+    bf_free(&rest);
+    free(accesses);
+    free(cells);
+    free(entry);
+}
+
+void bf_convert_once_loops(struct bf_program* prog) {
+    int count = 0;
+
+    /* The IR is unchanged apart from the delimiter types, matches stay. */
+    for (int i = 0; i < prog->len; ++i) {
+        if (prog->ops[i].type == BF_OP_LOOP && runs_once(prog, i)) {
+            prog->ops[i].type = BF_OP_IF;
+            prog->ops[prog->ops[i].match].type = BF_OP_ENDIF;
+            ++count;
+        }
+    }
+
+    if (count) {
+        fprintf(stderr, "info: converted %d at-most-once loops to ifs\n", count);
+    }
+}
+
+int runs_once(const struct bf_program* prog, int loop) {
+    int end = prog->ops[loop].match;
+    int* entry = malloc(sizeof(int) * (end - loop));
+    int* cond = malloc(sizeof(int) * (end - loop));
+    int pos = 0, depth = 0, zero = 0, balanced = 1;
+
+    for (int i = loop + 1; i < end && balanced; ++i) {
+        const struct bf_op* op = &prog->ops[i];
+        int cell = pos + op->offset;
+
+        switch (op->type) {
+        case BF_OP_SET:
+            if (cell == 0) zero = !depth && !op->arg;
+            break;
+        case BF_OP_ADD:
+        case BF_OP_INPUT:
+        case BF_OP_MUL:
+            if (cell == 0) zero = 0;
+            break;
+        case BF_OP_VEC:
+            /* A lane that keeps its cell is no write. */
+            if (cell <= 0 && cell + op->arg > 0) {
+                const struct bf_vec* vec = &prog->vecs[op->match];
+                int lane = -cell;
+
+                if (vec->mask[lane] != 0xff || vec->add[lane]) {
+                    zero = !depth && !vec->mask[lane] && !vec->add[lane];
+                }
+            }
+            break;
+        case BF_OP_MOVE:
+            pos += op->arg;
+            break;
+        case BF_OP_OUTPUT:
+            break;
+        case BF_OP_LOOP:
+        case BF_OP_IF:
+            entry[depth] = pos;
+            cond[depth++] = op->type == BF_OP_LOOP && cell == 0;
+            break;
+        case BF_OP_END:
+        case BF_OP_ENDIF:
+            balanced = entry[--depth] == pos;
+
+            /* A loop on the condition cell only exits once it is zero,
+             * unless it is nested in a construct that may not run. */
+            if (cond[depth] && !depth) zero = 1;
+            break;
+        }
+    }
+
+    free(entry);
+    free(cond);
+
+    return balanced && !pos && zero;
+}
+
+void bf_evaluate_prefix(struct bf_program* prog, int tape_length) {
+    struct eval_state st = {
+        .tape   = calloc(tape_length, 1),
+        .length = tape_length,
+        .output = malloc(BF_EVAL_OUTPUT_LIMIT),
+    };
+    int resume = 0;
+
+    /*
+     * Top-level operations are evaluated whole. When a loop can't be
+     * finished, its writes are undone and the compiled program resumes
+     * at the start of the loop.
+     */
+    while (resume < prog->len) {
+        const struct bf_op* op = &prog->ops[resume];
+        int end = op->type == BF_OP_LOOP || op->type == BF_OP_IF ? op->match + 1 : resume + 1;
+        int ip = resume, pos = st.pos, output_len = st.output_len, status = 0;
+
+        st.undo_len = 0;
+
+        while (ip < end && !(status = eval_step(&st, prog, &ip)));
+
+        if (status) {
+            while (st.undo_len) {
+                --st.undo_len;
+                st.tape[st.undo[st.undo_len].cell] = st.undo[st.undo_len].value;
+            }
+
+            st.pos = pos;
+            st.output_len = output_len;
+            break;
+        }
+
+        resume = end;
+    }
+
+    if (resume) {
+        struct bf_program out = { 0 };
+
+        /* The output so far is replayed through the current cell, which
+         * then gets its final value along with every other cell. */
+        if (st.pos) {
+            bf_append(&out, BF_OP_MOVE, 0, st.pos);
+        }
+
+        for (int i = 0; i < st.output_len; ++i) {
+            bf_append(&out, BF_OP_SET, 0, st.output[i]);
+            bf_append(&out, BF_OP_OUTPUT, 0, 0);
+        }
+
+        for (int cell = 0; cell < st.length; ++cell) {
+            if (st.tape[cell] || (cell == st.pos && st.output_len)) {
+                bf_append(&out, BF_OP_SET, cell - st.pos, st.tape[cell]);
+            }
+        }
+
+        for (int i = resume; i < prog->len; ++i) {
+            bf_append_copy(&out, prog, &prog->ops[i], 0);
+        }
+
+        fprintf(stderr, "info: evaluated %ld steps of the program at compile time\n", st.steps);
+
+        bf_rematch(&out);
+        bf_free(prog);
+        *prog = out;
+    }
+
+    free(st.tape);
+    free(st.output);
+    free(st.undo);
+}
+
+int eval_step(struct eval_state* st, const struct bf_program* prog, int* ip) {
+    const struct bf_op* op = &prog->ops[*ip];
+    const struct bf_vec* vec = op->type == BF_OP_VEC ? &prog->vecs[op->match] : NULL;
+    int cell = st->pos + (op->type == BF_OP_END ? prog->ops[op->match].offset : op->offset);
+    int last = op->type == BF_OP_VEC ? cell + op->arg - 1 : cell;
+
+    if (++st->steps > BF_EVAL_STEP_LIMIT) {
+        return -1;
+    }
+
+    if (op->type == BF_OP_MOVE) {
+        if (st->pos + op->arg < 0 || st->pos + op->arg >= st->length) {
+            return -1;
+        }
+
+        st->pos += op->arg;
+        ++*ip;
+        return 0;
+    }
+
+    if (cell < 0 || last >= st->length || (op->type == BF_OP_MUL && (st->pos + op->src < 0 || st->pos + op->src >= st->length))) {
+        return -1;
+    }
+
+    switch (op->type) {
+    case BF_OP_ADD:
+        eval_write(st, cell, st->tape[cell] + op->arg);
+        break;
+    case BF_OP_SET:
+        eval_write(st, cell, op->arg);
+        break;
+    case BF_OP_MUL:
+        eval_write(st, cell, st->tape[cell] + st->tape[st->pos + op->src] * op->arg);
+        break;
+    case BF_OP_VEC:
+        for (int lane = 0; lane < op->arg; ++lane) {
+            eval_write(st, cell + lane, (st->tape[cell + lane] & vec->mask[lane]) + vec->add[lane]);
+        }
+        break;
+    case BF_OP_OUTPUT:
+        if (st->output_len == BF_EVAL_OUTPUT_LIMIT) {
+            return -1;
+        }
+
+        st->output[st->output_len++] = st->tape[cell];
+        break;
+    case BF_OP_INPUT:
+        return -1;
+    case BF_OP_LOOP:
+    case BF_OP_IF:
+        if (!st->tape[cell]) {
+            *ip = op->match + 1;
+            return 0;
+        }
+        break;
+    case BF_OP_END:
+        if (st->tape[cell]) {
+            *ip = op->match + 1;
+            return 0;
+        }
+        break;
+    default:
+        break;
+    }
+
+    ++*ip;
+    return 0;
+}
+
+void eval_write(struct eval_state* st, int cell, int value) {
+    if (st->undo_len == st->undo_cap) {
+        st->undo_cap = st->undo_cap ? st->undo_cap * 2 : 256;
+        st->undo = realloc(st->undo, sizeof(struct cell_write) * st->undo_cap);
+    }
+
+    st->undo[st->undo_len++] = (struct cell_write) { cell, st->tape[cell] };
+    st->tape[cell] = value;
+}
+
+int inverse_mod256(int n) {
+    int inverse = 1;
+
+    while (((inverse * n) & 0xff) != 1) {
+        inverse += 2;
+    }
+
+    return inverse;
+}
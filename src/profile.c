@@ -0,0 +1,87 @@
+/*
+ * bfoc: brainfuck optimizing compiler
+ * codeandkey
+ *
+ * Branch profiles. Programs built with -p count how often each loop and if
+ * condition is tested and taken, and write the counts out at exit. Builds
+ * with -u read them back to lay out hot and cold code.
+ */
+
+#include "bfoc.h"
+
+#include <stdlib.h>
+
+int bf_profile_load(const char* path, struct bf_profile* profile) {
+    char line[256];
+    int len = -1, site;
+    unsigned long long tests, taken;
+
+    FILE* f = fopen(path, "r");
+
+    if (!f) {
+        return -1;
+    }
+
+    profile->sites = NULL;
+    profile->len = 0;
+    profile->peak = 0;
+
+    while (fgets(line, sizeof line, f)) {
+        if (*line == '#') {
+            int sites;
+
+            if (sscanf(line, "# sites: %d", &sites) != 1 || sites < 0) {
+                continue;
+            }
+
+            /* A second header would leak the first one's counts. */
+            if (profile->sites || !(profile->sites = calloc(sites + 1, sizeof *profile->sites))) {
+                len = -1;
+                break;
+            }
+
+            len = profile->len = sites;
+            continue;
+        }
+
+        /* Counts before the site count or for unknown sites are bogus. */
+        if (sscanf(line, "%d %llu %llu", &site, &tests, &taken) != 3 || site < 0 || site >= profile->len) {
+            len = -1;
+            break;
+        }
+
+        profile->sites[site].tests = tests;
+        profile->sites[site].taken = taken;
+
+        if (tests > profile->peak) {
+            profile->peak = tests;
+        }
+    }
+
+    fclose(f);
+
+    if (len < 0) {
+        bf_profile_free(profile);
+        return -1;
+    }
+
+    return 0;
+}
+
+void bf_profile_free(struct bf_profile* profile) {
+    free(profile->sites);
+    profile->sites = NULL;
+    profile->len = 0;
+}
+
+int bf_profile_sites(const struct bf_program* prog) {
+    int sites = 0;
+
+    for (int i = 0; i < prog->len; ++i) {
+        if (prog->ops[i].type == BF_OP_LOOP || prog->ops[i].type == BF_OP_IF) {
+            ++sites;
+        }
+    }
+
+    return sites;
+}